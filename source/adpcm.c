@@ -36,7 +36,15 @@ freely, subject to the following restrictions:
 static const int16_t filter_k1[ADPCM_FILTER_COUNT] = {0, 60, 115, 98, 122};
 static const int16_t filter_k2[ADPCM_FILTER_COUNT] = {0, 0, -52, -55, -60};
 
-static int find_min_shift(const psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, int pitch, int filter, int shift_range) {
+// The generic encoder below is always inlined into the kernels further down, which pass it compile-time
+// constant strides, shifts and filter counts so that the 28-sample loops can be folded per configuration.
+#if defined(__GNUC__)
+#define ADPCM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ADPCM_ALWAYS_INLINE inline
+#endif
+
+static ADPCM_ALWAYS_INLINE int find_min_shift(const psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, int pitch, int filter, int shift_range) {
 	// Assumption made:
 	//
 	// There is value in shifting right one step further to allow the nibbles to clip.
@@ -71,7 +79,7 @@ static int find_min_shift(const psx_audio_encoder_channel_state_t *state, int16_
 	return min_shift;
 }
 
-static uint8_t attempt_to_encode(psx_audio_encoder_channel_state_t *outstate, const psx_audio_encoder_channel_state_t *instate, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter, int sample_shift, int shift_range) {
+static ADPCM_ALWAYS_INLINE uint8_t attempt_to_encode(psx_audio_encoder_channel_state_t *outstate, const psx_audio_encoder_channel_state_t *instate, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter, int sample_shift, int shift_range) {
 	uint8_t sample_mask = 0xFFFF >> shift_range;
 	uint8_t nondata_mask = ~(sample_mask << data_shift);
 
@@ -120,7 +128,7 @@ static uint8_t attempt_to_encode(psx_audio_encoder_channel_state_t *outstate, co
 	return hdr;
 }
 
-static uint8_t encode(psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter_count, int shift_range) {
+static ADPCM_ALWAYS_INLINE uint8_t encode(psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, int pitch, uint8_t *data, int data_shift, int data_pitch, int filter_count, int shift_range) {
     psx_audio_encoder_channel_state_t proposed;
 	int64_t best_mse = ((int64_t)1<<(int64_t)50);
 	int best_filter = 0;
@@ -161,39 +169,64 @@ static uint8_t encode(psx_audio_encoder_channel_state_t *state, int16_t *samples
 		best_filter, best_sample_shift, shift_range);
 }
 
-static void encode_block_xa(int16_t *audio_samples, int audio_samples_limit, uint8_t *data, psx_audio_xa_settings_t settings, psx_audio_encoder_state_t *state) {
+// Every block but the last one is complete, so it gets its own copy without the per-sample end check
+#define DEFINE_ENCODE_KERNEL(name, pitch, data_shift, data_pitch, filter_count, shift_range) \
+	static uint8_t name(psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, uint8_t *data) { \
+		if (sample_limit >= 28) { \
+			return encode(state, samples, 28, pitch, data, data_shift, data_pitch, filter_count, shift_range); \
+		} \
+		return encode(state, samples, sample_limit, pitch, data, data_shift, data_pitch, filter_count, shift_range); \
+	}
+
+typedef uint8_t (*encode_kernel_t)(psx_audio_encoder_channel_state_t *state, int16_t *samples, int sample_limit, uint8_t *data);
+
+//                   name                  pitch data_shift data_pitch filter_count            shift_range
+DEFINE_ENCODE_KERNEL(encode_spu_mono,      1,    0,         1,         SPU_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS)
+DEFINE_ENCODE_KERNEL(encode_spu_stereo,    2,    0,         1,         SPU_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS)
+DEFINE_ENCODE_KERNEL(encode_xa4_mono_lo,   1,    0,         4,         XA_ADPCM_FILTER_COUNT,  SHIFT_RANGE_4BPS)
+DEFINE_ENCODE_KERNEL(encode_xa4_mono_hi,   1,    4,         4,         XA_ADPCM_FILTER_COUNT,  SHIFT_RANGE_4BPS)
+DEFINE_ENCODE_KERNEL(encode_xa4_stereo_lo, 2,    0,         4,         XA_ADPCM_FILTER_COUNT,  SHIFT_RANGE_4BPS)
+DEFINE_ENCODE_KERNEL(encode_xa4_stereo_hi, 2,    4,         4,         XA_ADPCM_FILTER_COUNT,  SHIFT_RANGE_4BPS)
+DEFINE_ENCODE_KERNEL(encode_xa8_mono,      1,    0,         4,         XA_ADPCM_FILTER_COUNT,  SHIFT_RANGE_8BPS)
+DEFINE_ENCODE_KERNEL(encode_xa8_stereo,    2,    0,         4,         XA_ADPCM_FILTER_COUNT,  SHIFT_RANGE_8BPS)
+
+// Sound units 0-3 have their headers at 0-3, sound units 4-7 at 8-11 (4-7 and 12-15 hold copies)
+#define XA_UNIT_HEADER(unit) (((unit) & 3) | (((unit) & 4) << 1))
+
+typedef void (*encode_block_xa_t)(int16_t *audio_samples, int audio_samples_limit, uint8_t *data, psx_audio_encoder_state_t *state);
+
+static void encode_block_xa4_mono(int16_t *audio_samples, int audio_samples_limit, uint8_t *data, psx_audio_encoder_state_t *state) {
+	for (int unit = 0; unit < 8; unit += 2) {
+		data[XA_UNIT_HEADER(unit)]     = encode_xa4_mono_lo(&(state->left), audio_samples + 28*unit,     audio_samples_limit - 28*unit,     data + 0x10 + (unit >> 1));
+		data[XA_UNIT_HEADER(unit + 1)] = encode_xa4_mono_hi(&(state->left), audio_samples + 28*(unit+1), audio_samples_limit - 28*(unit+1), data + 0x10 + (unit >> 1));
+	}
+}
+
+static void encode_block_xa4_stereo(int16_t *audio_samples, int audio_samples_limit, uint8_t *data, psx_audio_encoder_state_t *state) {
+	for (int unit = 0; unit < 8; unit += 2) {
+		data[XA_UNIT_HEADER(unit)]     = encode_xa4_stereo_lo(&(state->left),  audio_samples + 28*unit,     audio_samples_limit - 14*unit, data + 0x10 + (unit >> 1));
+		data[XA_UNIT_HEADER(unit + 1)] = encode_xa4_stereo_hi(&(state->right), audio_samples + 28*unit + 1, audio_samples_limit - 14*unit, data + 0x10 + (unit >> 1));
+	}
+}
+
+static void encode_block_xa8_mono(int16_t *audio_samples, int audio_samples_limit, uint8_t *data, psx_audio_encoder_state_t *state) {
+	for (int unit = 0; unit < 4; unit++) {
+		data[unit] = encode_xa8_mono(&(state->left), audio_samples + 28*unit, audio_samples_limit - 28*unit, data + 0x10 + unit);
+	}
+}
+
+static void encode_block_xa8_stereo(int16_t *audio_samples, int audio_samples_limit, uint8_t *data, psx_audio_encoder_state_t *state) {
+	for (int unit = 0; unit < 4; unit += 2) {
+		data[unit]     = encode_xa8_stereo(&(state->left),  audio_samples + 28*unit,     audio_samples_limit - 14*unit, data + 0x10 + unit);
+		data[unit + 1] = encode_xa8_stereo(&(state->right), audio_samples + 28*unit + 1, audio_samples_limit - 14*unit, data + 0x11 + unit);
+	}
+}
+
+static encode_block_xa_t get_encode_block_xa(psx_audio_xa_settings_t settings) {
 	if (settings.bits_per_sample == 4) {
-		if (settings.stereo) {
-			data[0]  = encode(&(state->left),  audio_samples,            audio_samples_limit,        2, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[1]  = encode(&(state->right), audio_samples + 1,        audio_samples_limit,        2, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[2]  = encode(&(state->left),  audio_samples + 56,       audio_samples_limit - 28,   2, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[3]  = encode(&(state->right), audio_samples + 56 + 1,   audio_samples_limit - 28,   2, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[8]  = encode(&(state->left),  audio_samples + 56*2,     audio_samples_limit - 28*2, 2, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[9]  = encode(&(state->right), audio_samples + 56*2 + 1, audio_samples_limit - 28*2, 2, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[10] = encode(&(state->left),  audio_samples + 56*3,     audio_samples_limit - 28*3, 2, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[11] = encode(&(state->right), audio_samples + 56*3 + 1, audio_samples_limit - 28*3, 2, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-		} else {
-			data[0]  = encode(&(state->left), audio_samples,        audio_samples_limit,        1, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[1]  = encode(&(state->left), audio_samples + 28,   audio_samples_limit - 28,   1, data + 0x10, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[2]  = encode(&(state->left), audio_samples + 28*2, audio_samples_limit - 28*2, 1, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[3]  = encode(&(state->left), audio_samples + 28*3, audio_samples_limit - 28*3, 1, data + 0x11, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[8]  = encode(&(state->left), audio_samples + 28*4, audio_samples_limit - 28*4, 1, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[9]  = encode(&(state->left), audio_samples + 28*5, audio_samples_limit - 28*5, 1, data + 0x12, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[10] = encode(&(state->left), audio_samples + 28*6, audio_samples_limit - 28*6, 1, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-			data[11] = encode(&(state->left), audio_samples + 28*7, audio_samples_limit - 28*7, 1, data + 0x13, 4, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
-		}
+		return settings.stereo ? encode_block_xa4_stereo : encode_block_xa4_mono;
 	} else {
-		if (settings.stereo) {
-			data[0] = encode(&(state->left),  audio_samples,          audio_samples_limit,      2, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[1] = encode(&(state->right), audio_samples + 1,      audio_samples_limit,      2, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[2] = encode(&(state->left),  audio_samples + 56,     audio_samples_limit - 28, 2, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[3] = encode(&(state->right), audio_samples + 56 + 1, audio_samples_limit - 28, 2, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-		} else {
-			data[0] = encode(&(state->left), audio_samples,        audio_samples_limit,        1, data + 0x10, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[1] = encode(&(state->left), audio_samples + 28,   audio_samples_limit - 28,   1, data + 0x11, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[2] = encode(&(state->left), audio_samples + 28*2, audio_samples_limit - 28*2, 1, data + 0x12, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-			data[3] = encode(&(state->left), audio_samples + 28*3, audio_samples_limit - 28*3, 1, data + 0x13, 0, 4, XA_ADPCM_FILTER_COUNT, SHIFT_RANGE_8BPS);
-		}
+		return settings.stereo ? encode_block_xa8_stereo : encode_block_xa8_mono;
 	}
 }
 
@@ -257,6 +290,7 @@ int psx_audio_xa_encode(psx_audio_xa_settings_t settings, psx_audio_encoder_stat
 	int xa_sector_size = settings.format == PSX_AUDIO_XA_FORMAT_XA ? 2336 : 2352;
 	int xa_offset = 2352 - xa_sector_size;
 	uint8_t init_sector = 1;
+	encode_block_xa_t encode_block_xa = get_encode_block_xa(settings);
 
 	if (settings.stereo) { sample_count <<= 1; }
 	
@@ -269,7 +303,7 @@ int psx_audio_xa_encode(psx_audio_xa_settings_t settings, psx_audio_encoder_stat
 			init_sector = 0;
 		}
 
-		encode_block_xa(samples + i, sample_count - i, block_data, settings, state);
+		encode_block_xa(samples + i, sample_count - i, block_data, state);
 
 		memcpy(block_data + 4, block_data, 4);
 		memcpy(block_data + 12, block_data + 8, 4);
@@ -302,8 +336,17 @@ int psx_audio_spu_encode(psx_audio_encoder_channel_state_t *state, int16_t* samp
 	uint8_t prebuf[28];
 	uint8_t *buffer = output;
 
+	// Mono and interleaved stereo input have their own kernels, anything else takes the generic path
+	encode_kernel_t encode_spu = NULL;
+	if (pitch == 1) { encode_spu = encode_spu_mono; }
+	if (pitch == 2) { encode_spu = encode_spu_stereo; }
+
 	for (int i = 0; i < sample_count; i += 28, buffer += 16) {
-		buffer[0] = encode(state, samples + i * pitch, sample_count - i, pitch, prebuf, 0, 1, SPU_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
+		if (encode_spu != NULL) {
+			buffer[0] = encode_spu(state, samples + i * pitch, sample_count - i, prebuf);
+		} else {
+			buffer[0] = encode(state, samples + i * pitch, sample_count - i, pitch, prebuf, 0, 1, SPU_ADPCM_FILTER_COUNT, SHIFT_RANGE_4BPS);
+		}
 		buffer[1] = 0;
 
 		for (int j = 0; j < 28; j+=2) {
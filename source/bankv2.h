@@ -0,0 +1,408 @@
+#ifndef BANKV2
+#define BANKV2
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "soundbank.h"
+
+// Version 2 of the bank format keeps the same sample data, but shrinks the tables a game keeps resident in main RAM:
+// only instruments that exist are listed, regions are one packed word and a 16-bit articulation index each, with their
+// envelope and mix settings moved to a shared articulation table, and sample headers count 16-byte ADPCM blocks.
+// It only holds SPU-ADPCM banks.
+//
+// File layout: BankHeaderV2, InstMapEntry[n_instruments], uint32_t regions[n_regions],
+// uint16_t region_articulations[n_regions], Articulation[n_articulations], SampleHeaderV2[n_samples], then the upload
+// chunk table (if any) and the sample data
+#define BANK_V2_MAX_SAMPLES 1024
+#define BANK_V2_MAX_ARTICULATIONS 0xFFFF
+#define SAMPLE_V2_NO_LOOP 0xFFFF
+
+typedef struct {
+    char magic[4];                  // "FSB2"
+    uint16_t n_instruments;         // Number of InstMapEntry entries
+    uint16_t n_regions;             // Number of packed regions
+    uint16_t n_articulations;       // Number of Articulation entries
+    uint16_t n_samples;             // Number of SampleHeaderV2 entries
+    uint32_t offset_chunk_table;    // Offset (bytes) of the upload chunk table relative to the end of this header, 0 if there is none
+    uint32_t offset_sample_data;    // Offset (bytes) of the sample data chunk, relative to the end of this header
+    uint32_t size_sample_data;      // Size (bytes) of the sample data chunk
+} BankHeaderV2;
+
+// Sorted by instrument ID, so a loader can binary search it, or expand it into a 256-entry lookup table
+typedef struct {
+    uint8_t instrument_id;
+    uint8_t n_regions;
+    uint16_t first_region;          // Index of this instrument's first region in the region table
+} InstMapEntry;
+
+// Regions are packed into one uint32_t each, and sorted by key_min within each instrument so a note-on can stop
+// scanning at the first region that starts above the key. Each region's articulation index is in a separate uint16_t
+// table with the same order:
+//     bits  0- 6  key_min
+//     bits  7-13  key_max
+//     bits 14-23  sample index
+//     bit     24  sample is in the base bank (SAMPLE_INDEX_EXTERNAL)
+//     bits 25-31  reserved, 0
+#define REGION_V2_KEY_MIN(region)       ((region) & 0x7F)
+#define REGION_V2_KEY_MAX(region)       (((region) >> 7) & 0x7F)
+#define REGION_V2_SAMPLE(region)        (((region) >> 14) & 0x3FF)
+#define REGION_V2_EXTERNAL(region)      (((region) >> 24) & 0x1)
+#define REGION_V2_PACK(key_min, key_max, sample, external) \
+    ((uint32_t)(key_min) | ((uint32_t)(key_max) << 7) | ((uint32_t)(sample) << 14) | ((uint32_t)(external) << 24))
+
+// Everything about a region except its key range and sample, shared between all regions that sound the same
+typedef struct {
+    uint16_t delay;         // Delay stage length in milliseconds
+    uint16_t attack;        // Attack stage length in milliseconds
+    uint16_t hold;          // Hold stage length in milliseconds
+    uint16_t decay;         // Decay stage length in milliseconds
+    uint16_t sustain;       // Sustain volume where 0 = 0.0 and 65535 = 1.0
+    uint16_t release;       // Release stage length in milliseconds
+    uint16_t volume;        // Volume for this region
+    uint16_t panning;       // Panning for this region, 0 = left, 127 = middle, 254 = right
+} Articulation;
+
+typedef struct {
+    uint16_t start;         // Offset into the sample data chunk in 16-byte blocks. The SPU Sample Start Address register counts 8-byte units, so it takes start * 2
+    uint16_t length;        // Number of 16-byte blocks
+    uint16_t loop_start;    // Block to return to after the end of the sample, relative to start, or SAMPLE_V2_NO_LOOP
+    uint16_t sample_rate;   // Sample rate (Hz) at MIDI key 60 (C5)
+} SampleHeaderV2;
+
+static void bank_append(uint8_t** buffer, uint32_t* size, uint32_t* capacity, const void* data, uint32_t length) {
+    while (*size + length > *capacity) {
+        *capacity = (*capacity == 0) ? 4096 : (*capacity * 2);
+        *buffer = realloc(*buffer, *capacity);
+    }
+    if (data != NULL) {
+        memcpy(*buffer + *size, data, length);
+    }
+    else {
+        memset(*buffer + *size, 0, length);
+    }
+    *size += length;
+}
+
+static void bank_pad(uint8_t** buffer, uint32_t* size, uint32_t* capacity, uint32_t alignment) {
+    uint32_t padded = (*size + alignment - 1) / alignment * alignment;
+    bank_append(buffer, size, capacity, NULL, padded - *size);
+}
+
+// Converts a v1 (.sbk "FSBK") bank to v2. Returns the new file, or NULL if the bank doesn't fit in v2
+uint8_t* convert_bank_to_v2(const uint8_t* file, uint32_t size, uint32_t* new_size) {
+    Soundbank bank;
+    if (!parse_soundbank(file, size, &bank)) {
+        printf("Invalid soundbank\n");
+        return NULL;
+    }
+    if (bank.header.n_samples > BANK_V2_MAX_SAMPLES) {
+        printf("Too many samples for a v2 bank (%u, at most %i)\n", bank.header.n_samples, BANK_V2_MAX_SAMPLES);
+        return NULL;
+    }
+
+    // Sample headers
+    SampleHeaderV2* samples = malloc((bank.header.n_samples + 1) * sizeof(SampleHeaderV2));
+    for (uint32_t i = 0; i < bank.header.n_samples; ++i) {
+        const SampleHeader* sample = &bank.sample_headers[i];
+        if (sample->format != 0) {
+            printf("Only SPU-ADPCM banks can be converted to v2\n");
+            free(samples);
+            return NULL;
+        }
+        // SAMPLE_V2_NO_LOOP is reserved, so the loop block has to stay below it
+        if (sample->sample_start / 16 > 0xFFFF || sample->sample_length > 0xFFFFu * 28 || sample->sample_rate > 0xFFFF
+            || (sample->loop_start != UINT32_MAX && sample->loop_start / 28 >= SAMPLE_V2_NO_LOOP)) {
+            printf("Sample %u doesn't fit in a v2 sample header\n", i);
+            free(samples);
+            return NULL;
+        }
+        samples[i] = (SampleHeaderV2){
+            .start = sample->sample_start / 16,
+            .length = (sample->sample_length + 27) / 28,
+            .loop_start = (sample->loop_start == UINT32_MAX) ? SAMPLE_V2_NO_LOOP : (sample->loop_start / 28),
+            .sample_rate = sample->sample_rate,
+        };
+    }
+
+    // Instruments, regions and articulations
+    InstMapEntry instruments[256];
+    uint32_t* regions = malloc((bank.n_regions + 1) * sizeof(uint32_t));
+    uint16_t* region_articulations = malloc((bank.n_regions + 1) * sizeof(uint16_t));
+    Articulation* articulations = malloc((bank.n_regions + 1) * sizeof(Articulation));
+    int n_instruments = 0;
+    int n_regions = 0;
+    int n_articulations = 0;
+    for (int i = 0; i < 256; ++i) {
+        const InstDesc* inst = &bank.inst_descs[i];
+        if (inst->n_regions == 0)
+            continue;
+        if (inst->n_regions > 255) {
+            printf("Instrument %i has too many regions for a v2 bank\n", i);
+            free(samples);
+            free(regions);
+            free(region_articulations);
+            free(articulations);
+            return NULL;
+        }
+
+        instruments[n_instruments++] = (InstMapEntry){ .instrument_id = i, .n_regions = inst->n_regions, .first_region = n_regions };
+        for (int r = inst->region_start_index; r < inst->region_start_index + inst->n_regions; ++r) {
+            const InstRegion* region = &bank.regions[r];
+            Articulation articulation = {
+                .delay = region->delay,
+                .attack = region->attack,
+                .hold = region->hold,
+                .decay = region->decay,
+                .sustain = region->sustain,
+                .release = region->release,
+                .volume = region->volume,
+                .panning = region->panning,
+            };
+            int a = 0;
+            while (a < n_articulations && memcmp(&articulations[a], &articulation, sizeof(articulation)) != 0) {
+                a++;
+            }
+            if (a == n_articulations) {
+                if (n_articulations == BANK_V2_MAX_ARTICULATIONS) {
+                    printf("Too many different envelope/volume/panning combinations for a v2 bank (at most %i)\n", BANK_V2_MAX_ARTICULATIONS);
+                    free(samples);
+                    free(regions);
+                    free(region_articulations);
+                    free(articulations);
+                    return NULL;
+                }
+                articulations[n_articulations++] = articulation;
+            }
+
+            uint32_t packed = REGION_V2_PACK(region->key_min & 0x7F, region->key_max & 0x7F, region->sample_index & 0x3FF,
+                (region->sample_index & SAMPLE_INDEX_EXTERNAL) ? 1 : 0);
+
+            // Keep the instrument's regions sorted by key_min, stable so layered regions keep their order
+            int j = n_regions++;
+            while (j > instruments[n_instruments - 1].first_region && REGION_V2_KEY_MIN(regions[j - 1]) > REGION_V2_KEY_MIN(packed)) {
+                regions[j] = regions[j - 1];
+                region_articulations[j] = region_articulations[j - 1];
+                j--;
+            }
+            regions[j] = packed;
+            region_articulations[j] = a;
+        }
+    }
+
+    // Sample data is copied as-is, including any sector padding after it. If the v1 bank streams its sample data from
+    // sector-aligned chunks, so does this one
+    uint32_t old_data_start = sizeof(BankHeader) + bank.header.offset_sample_data;
+    int align_sectors = (bank.chunk_table != NULL && old_data_start % CD_SECTOR_SIZE == 0);
+    BankHeaderV2 header = {
+        .magic = { 'F', 'S', 'B', '2' },
+        .n_instruments = n_instruments,
+        .n_regions = n_regions,
+        .n_articulations = n_articulations,
+        .n_samples = bank.header.n_samples,
+        .offset_chunk_table = 0,
+        .offset_sample_data = 0,
+        .size_sample_data = bank.header.size_sample_data,
+    };
+
+    uint8_t* out = NULL;
+    uint32_t out_size = 0;
+    uint32_t out_capacity = 0;
+    bank_append(&out, &out_size, &out_capacity, &header, sizeof(header));
+    bank_append(&out, &out_size, &out_capacity, instruments, n_instruments * sizeof(InstMapEntry));
+    bank_append(&out, &out_size, &out_capacity, regions, n_regions * sizeof(uint32_t));
+    bank_append(&out, &out_size, &out_capacity, region_articulations, n_regions * sizeof(uint16_t));
+    bank_append(&out, &out_size, &out_capacity, articulations, n_articulations * sizeof(Articulation));
+    bank_append(&out, &out_size, &out_capacity, samples, bank.header.n_samples * sizeof(SampleHeaderV2));
+    uint32_t chunk_table_start = 0;
+    if (bank.chunk_table != NULL) {
+        bank_pad(&out, &out_size, &out_capacity, 4);
+        chunk_table_start = out_size;
+        bank_append(&out, &out_size, &out_capacity, bank.chunk_table, sizeof(UploadChunkTable) + bank.chunk_table->n_chunks * sizeof(UploadChunk));
+    }
+    bank_pad(&out, &out_size, &out_capacity, align_sectors ? CD_SECTOR_SIZE : 16);
+    uint32_t data_start = out_size;
+    bank_append(&out, &out_size, &out_capacity, file + old_data_start, size - old_data_start);
+
+    // Fill in the offsets now that they're known, and move the chunks along with the sample data
+    header.offset_chunk_table = chunk_table_start ? (chunk_table_start - sizeof(header)) : 0;
+    header.offset_sample_data = data_start - sizeof(header);
+    memcpy(out, &header, sizeof(header));
+    if (bank.chunk_table != NULL) {
+        UploadChunk* chunks = (UploadChunk*)(out + chunk_table_start + sizeof(UploadChunkTable));
+        for (uint32_t i = 0; i < bank.chunk_table->n_chunks; ++i) {
+            chunks[i].file_offset = chunks[i].file_offset - old_data_start + data_start;
+        }
+    }
+
+    free(samples);
+    free(regions);
+    free(region_articulations);
+    free(articulations);
+    *new_size = out_size;
+    return out;
+}
+
+// Converts a v2 (.sbk "FSB2") bank back to v1. Sample lengths and loop points come back rounded to whole blocks.
+// Returns the new file, or NULL if it isn't a valid v2 bank
+uint8_t* convert_bank_to_v1(const uint8_t* file, uint32_t size, uint32_t* new_size) {
+    BankHeaderV2 header;
+    if (size < sizeof(header)) {
+        printf("Invalid v2 soundbank\n");
+        return NULL;
+    }
+    memcpy(&header, file, sizeof(header));
+    const uint8_t* tables = file + sizeof(header);
+    const InstMapEntry* instruments = (const InstMapEntry*)tables;
+    const uint32_t* regions = (const uint32_t*)(instruments + header.n_instruments);
+    const uint16_t* region_articulations = (const uint16_t*)(regions + header.n_regions);
+    const Articulation* articulations = (const Articulation*)(region_articulations + header.n_regions);
+    const SampleHeaderV2* samples = (const SampleHeaderV2*)(articulations + header.n_articulations);
+    if (memcmp(header.magic, "FSB2", 4) != 0
+        || (const uint8_t*)(samples + header.n_samples) > file + size
+        || sizeof(header) + header.offset_sample_data > size) {
+        printf("Invalid v2 soundbank\n");
+        return NULL;
+    }
+    const UploadChunkTable* chunk_table = NULL;
+    if (header.offset_chunk_table != 0) {
+        chunk_table = (const UploadChunkTable*)(tables + header.offset_chunk_table);
+        if (sizeof(header) + header.offset_chunk_table + sizeof(UploadChunkTable) + chunk_table->n_chunks * sizeof(UploadChunk) > size) {
+            printf("Invalid v2 soundbank\n");
+            return NULL;
+        }
+    }
+
+    // Every index has to point at something that exists
+    for (int i = 0; i < header.n_instruments; ++i) {
+        if (instruments[i].first_region + instruments[i].n_regions > header.n_regions) {
+            printf("Invalid v2 soundbank\n");
+            return NULL;
+        }
+    }
+    for (int i = 0; i < header.n_regions; ++i) {
+        if ((!REGION_V2_EXTERNAL(regions[i]) && REGION_V2_SAMPLE(regions[i]) >= header.n_samples) || region_articulations[i] >= header.n_articulations) {
+            printf("Invalid v2 soundbank\n");
+            return NULL;
+        }
+    }
+
+    InstDesc inst_descs[256] = { 0 };
+    InstRegion* v1_regions = malloc((header.n_regions + 1) * sizeof(InstRegion));
+    SampleHeader* v1_samples = malloc((header.n_samples + 1) * sizeof(SampleHeader));
+    if (v1_regions == NULL || v1_samples == NULL) {
+        printf("Out of memory\n");
+        free(v1_regions);
+        free(v1_samples);
+        return NULL;
+    }
+    for (int i = 0; i < header.n_instruments; ++i) {
+        inst_descs[instruments[i].instrument_id].region_start_index = instruments[i].first_region;
+        inst_descs[instruments[i].instrument_id].n_regions = instruments[i].n_regions;
+    }
+    for (int i = 0; i < header.n_regions; ++i) {
+        uint32_t region = regions[i];
+        const Articulation* articulation = &articulations[region_articulations[i]];
+        v1_regions[i] = (InstRegion){
+            .sample_index = REGION_V2_SAMPLE(region) | (REGION_V2_EXTERNAL(region) ? SAMPLE_INDEX_EXTERNAL : 0),
+            .delay = articulation->delay,
+            .attack = articulation->attack,
+            .hold = articulation->hold,
+            .decay = articulation->decay,
+            .sustain = articulation->sustain,
+            .release = articulation->release,
+            .volume = articulation->volume,
+            .panning = articulation->panning,
+            .key_min = REGION_V2_KEY_MIN(region),
+            .key_max = REGION_V2_KEY_MAX(region),
+        };
+    }
+    for (int i = 0; i < header.n_samples; ++i) {
+        v1_samples[i] = (SampleHeader){
+            .sample_start = samples[i].start * 16,
+            .sample_length = samples[i].length * 28,
+            .sample_rate = samples[i].sample_rate,
+            .loop_start = (samples[i].loop_start == SAMPLE_V2_NO_LOOP) ? UINT32_MAX : (samples[i].loop_start * 28u),
+            .format = 0,
+        };
+    }
+
+    // Same layout as the generator writes, with --align-sectors if the v2 bank streams sector-aligned chunks
+    uint32_t old_data_start = sizeof(header) + header.offset_sample_data;
+    int align_sectors = (chunk_table != NULL && old_data_start % CD_SECTOR_SIZE == 0);
+    uint32_t table_alignment = align_sectors ? DMA_BLOCK_SIZE : 1;
+    BankHeader v1_header = { .magic = { 'F', 'S', 'B', 'K' }, .n_samples = header.n_samples, .size_sample_data = header.size_sample_data };
+    uint8_t* out = NULL;
+    uint32_t out_size = 0;
+    uint32_t out_capacity = 0;
+    bank_append(&out, &out_size, &out_capacity, &v1_header, sizeof(v1_header));
+    bank_pad(&out, &out_size, &out_capacity, table_alignment);
+    v1_header.offset_inst_descs = out_size - sizeof(v1_header);
+    bank_append(&out, &out_size, &out_capacity, inst_descs, sizeof(inst_descs));
+    bank_pad(&out, &out_size, &out_capacity, table_alignment);
+    v1_header.offset_region_table = out_size - sizeof(v1_header);
+    bank_append(&out, &out_size, &out_capacity, v1_regions, header.n_regions * sizeof(InstRegion));
+    bank_pad(&out, &out_size, &out_capacity, table_alignment);
+    v1_header.offset_sample_headers = out_size - sizeof(v1_header);
+    bank_append(&out, &out_size, &out_capacity, v1_samples, header.n_samples * sizeof(SampleHeader));
+    uint32_t chunk_table_start = 0;
+    if (chunk_table != NULL) {
+        bank_pad(&out, &out_size, &out_capacity, DMA_BLOCK_SIZE);
+        chunk_table_start = out_size;
+        bank_append(&out, &out_size, &out_capacity, chunk_table, sizeof(UploadChunkTable) + chunk_table->n_chunks * sizeof(UploadChunk));
+        bank_pad(&out, &out_size, &out_capacity, align_sectors ? CD_SECTOR_SIZE : 1);
+    }
+    uint32_t data_start = out_size;
+    v1_header.offset_sample_data = data_start - sizeof(v1_header);
+    bank_append(&out, &out_size, &out_capacity, file + old_data_start, size - old_data_start);
+
+    memcpy(out, &v1_header, sizeof(v1_header));
+    if (chunk_table != NULL) {
+        UploadChunk* chunks = (UploadChunk*)(out + chunk_table_start + sizeof(UploadChunkTable));
+        for (uint32_t i = 0; i < chunk_table->n_chunks; ++i) {
+            chunks[i].file_offset = chunks[i].file_offset - old_data_start + data_start;
+        }
+    }
+
+    free(v1_regions);
+    free(v1_samples);
+    *new_size = out_size;
+    return out;
+}
+
+// Rewrites the v1 bank at `path` as a v2 bank. Returns 0 on failure
+int compact_bank_file(const char* path) {
+    uint32_t size = 0;
+    uint8_t* file = read_file(path, &size);
+    if (file == NULL) {
+        return 0;
+    }
+    BankHeader old_header;
+    memcpy(&old_header, file, (size < sizeof(old_header)) ? size : sizeof(old_header));
+    uint32_t new_size = 0;
+    uint8_t* new_file = convert_bank_to_v2(file, size, &new_size);
+    free(file);
+    if (new_file == NULL) {
+        return 0;
+    }
+
+    FILE* out_file = fopen(path, "wb");
+    if (out_file == NULL) {
+        printf("Failed to open file '%s'\n", path);
+        free(new_file);
+        return 0;
+    }
+    fwrite(new_file, 1, new_size, out_file);
+    fclose(out_file);
+
+    // Compare what a game keeps resident in main RAM: everything up to and including the sample headers
+    const BankHeaderV2* header = (const BankHeaderV2*)new_file;
+    uint32_t size_tables_v1 = sizeof(BankHeader) + old_header.offset_sample_headers + old_header.n_samples * sizeof(SampleHeader);
+    uint32_t size_tables_v2 = sizeof(BankHeaderV2) + header->n_instruments * sizeof(InstMapEntry) + header->n_regions * sizeof(uint32_t)
+        + header->n_regions * sizeof(uint16_t) + header->n_articulations * sizeof(Articulation) + header->n_samples * sizeof(SampleHeaderV2);
+    printf("%s: v2 bank, %u bytes of tables (%u bytes as v1)\n", path, size_tables_v2, size_tables_v1);
+    free(new_file);
+    return 1;
+}
+#endif
@@ -0,0 +1,253 @@
+#ifndef CODEC
+#define CODEC
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Sample codecs for banks that are played back in software (the PC port) rather than by the SPU.
+// This header has no dependencies, so a player can include it as-is to decode the sample data of a bank.
+
+#define SPU_ADPCM_BLOCK_SIZE 16
+#define SPU_ADPCM_BLOCK_SAMPLES 28
+
+// IMA-ADPCM (SampleHeader.format 2) is stored in independent 64-byte blocks, so any block can be decoded on its
+// own, and several blocks can be decoded side by side. Every block starts with the decoder state before its
+// first sample, followed by 120 4-bit codes, low nibble first.
+#define IMA_ADPCM_BLOCK_SIZE 64
+#define IMA_ADPCM_BLOCK_SAMPLES 120
+
+typedef struct {
+    int16_t predictor;
+    uint8_t step_index;
+    uint8_t reserved;
+} ImaBlockHeader;
+
+typedef struct {
+    int32_t prev1;
+    int32_t prev2;
+} SpuAdpcmState;
+
+static const int16_t ima_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107,
+    118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894,
+    6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767,
+};
+static const int8_t ima_index_table[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+static const int16_t spu_adpcm_k1[5] = { 0, 60, 115, 98, 122 };
+static const int16_t spu_adpcm_k2[5] = { 0, 0, -52, -55, -60 };
+
+uint32_t ima_adpcm_get_buffer_size(int sample_count) {
+    return (uint32_t)((sample_count + IMA_ADPCM_BLOCK_SAMPLES - 1) / IMA_ADPCM_BLOCK_SAMPLES) * IMA_ADPCM_BLOCK_SIZE;
+}
+
+// Applies one 4-bit code to the decoder state, returns the new sample
+static inline int ima_adpcm_step(int* predictor, int* step_index, int code) {
+    int step = ima_step_table[*step_index];
+    int diff = step >> 3;
+    if (code & 4) diff += step;
+    if (code & 2) diff += step >> 1;
+    if (code & 1) diff += step >> 2;
+    *predictor += (code & 8) ? -diff : diff;
+    if (*predictor > +0x7FFF) *predictor = +0x7FFF;
+    if (*predictor < -0x8000) *predictor = -0x8000;
+    *step_index += ima_index_table[code];
+    if (*step_index < 0) *step_index = 0;
+    if (*step_index > 88) *step_index = 88;
+    return *predictor;
+}
+
+// Encodes one block, starting from the given decoder state, and leaves the state after the block in it.
+// Returns the squared error of the block
+static int64_t ima_adpcm_encode_block(const int16_t* samples, int sample_count, int* predictor, int* step_index, uint8_t* block) {
+    ImaBlockHeader header = { .predictor = *predictor, .step_index = *step_index, .reserved = 0 };
+    memcpy(block, &header, sizeof(header));
+    memset(block + sizeof(header), 0, IMA_ADPCM_BLOCK_SIZE - sizeof(header));
+
+    int64_t total_error = 0;
+    for (int i = 0; i < IMA_ADPCM_BLOCK_SAMPLES; ++i) {
+        int target = (i < sample_count) ? samples[i] : 0;
+
+        // Pick the code that lands closest to the input
+        int best_code = 0;
+        int best_error = INT32_MAX;
+        for (int code = 0; code < 16; ++code) {
+            int trial_predictor = *predictor;
+            int trial_step_index = *step_index;
+            int error = ima_adpcm_step(&trial_predictor, &trial_step_index, code) - target;
+            if (error < 0) error = -error;
+            if (error < best_error) {
+                best_error = error;
+                best_code = code;
+            }
+        }
+        ima_adpcm_step(predictor, step_index, best_code);
+        block[sizeof(header) + i / 2] |= best_code << ((i & 1) * 4);
+        total_error += (int64_t)best_error * best_error;
+    }
+    return total_error;
+}
+
+// Encodes mono 16-bit samples, padding the last block with silence. Returns the number of bytes written
+int ima_adpcm_encode(const int16_t* samples, int sample_count, uint8_t* output) {
+    int predictor = 0;
+    int step_index = 0;
+    uint8_t* block = output;
+    for (int start = 0; start < sample_count; start += IMA_ADPCM_BLOCK_SAMPLES, block += IMA_ADPCM_BLOCK_SIZE) {
+        // Every block carries its own step size, so it doesn't have to ramp up from the previous block's step
+        // size at a sudden attack. Try them all and keep the one that encodes this block best
+        int best_step_index = step_index;
+        int64_t best_error = INT64_MAX;
+        for (int trial_step_index = 0; trial_step_index <= 88; ++trial_step_index) {
+            int trial_predictor = predictor;
+            int trial_state = trial_step_index;
+            int64_t error = ima_adpcm_encode_block(samples + start, sample_count - start, &trial_predictor, &trial_state, block);
+            if (error < best_error) {
+                best_error = error;
+                best_step_index = trial_step_index;
+            }
+        }
+        step_index = best_step_index;
+        ima_adpcm_encode_block(samples + start, sample_count - start, &predictor, &step_index, block);
+    }
+    return block - output;
+}
+
+// Reference decoder for one IMA-ADPCM block, writes IMA_ADPCM_BLOCK_SAMPLES samples
+void ima_adpcm_decode_block(const uint8_t* block, int16_t* output) {
+    ImaBlockHeader header;
+    memcpy(&header, block, sizeof(header));
+    int predictor = header.predictor;
+    int step_index = (header.step_index > 88) ? 88 : header.step_index;
+    for (int i = 0; i < IMA_ADPCM_BLOCK_SAMPLES; ++i) {
+        int code = (block[sizeof(header) + i / 2] >> ((i & 1) * 4)) & 0x0F;
+        output[i] = ima_adpcm_step(&predictor, &step_index, code);
+    }
+}
+
+// Decodes `n_blocks` consecutive IMA-ADPCM blocks. The blocks are independent, so with SSE2 four of them are decoded
+// at once, one per 32-bit lane. Only the step table lookups are done per lane.
+void ima_adpcm_decode(const uint8_t* data, int n_blocks, int16_t* output) {
+    int b = 0;
+#if defined(__SSE2__)
+    const __m128i mask_1 = _mm_set1_epi32(1);
+    const __m128i mask_2 = _mm_set1_epi32(2);
+    const __m128i mask_4 = _mm_set1_epi32(4);
+    const __m128i mask_7 = _mm_set1_epi32(7);
+    const __m128i mask_8 = _mm_set1_epi32(8);
+    const __m128i three = _mm_set1_epi32(3);
+    const __m128i max_index = _mm_set1_epi32(88);
+    for (; b + 4 <= n_blocks; b += 4) {
+        const uint8_t* blocks[4];
+        int32_t predictors[4];
+        int32_t step_indices[4];
+        for (int lane = 0; lane < 4; ++lane) {
+            ImaBlockHeader header;
+            blocks[lane] = data + (b + lane) * IMA_ADPCM_BLOCK_SIZE;
+            memcpy(&header, blocks[lane], sizeof(header));
+            predictors[lane] = header.predictor;
+            step_indices[lane] = (header.step_index > 88) ? 88 : header.step_index;
+        }
+        __m128i predictor = _mm_loadu_si128((const __m128i*)predictors);
+        __m128i step_index = _mm_loadu_si128((const __m128i*)step_indices);
+
+        for (int i = 0; i < IMA_ADPCM_BLOCK_SAMPLES; ++i) {
+            int byte = sizeof(ImaBlockHeader) + i / 2;
+            int nibble_shift = (i & 1) * 4;
+            _mm_storeu_si128((__m128i*)step_indices, step_index);
+            __m128i code = _mm_set_epi32(
+                (blocks[3][byte] >> nibble_shift) & 0x0F, (blocks[2][byte] >> nibble_shift) & 0x0F,
+                (blocks[1][byte] >> nibble_shift) & 0x0F, (blocks[0][byte] >> nibble_shift) & 0x0F);
+            __m128i step = _mm_set_epi32(
+                ima_step_table[step_indices[3]], ima_step_table[step_indices[2]],
+                ima_step_table[step_indices[1]], ima_step_table[step_indices[0]]);
+
+            // diff = step/8 + step * (code & 4) + step/2 * (code & 2) + step/4 * (code & 1), negated if code & 8
+            __m128i diff = _mm_srai_epi32(step, 3);
+            diff = _mm_add_epi32(diff, _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(code, mask_4), mask_4), step));
+            diff = _mm_add_epi32(diff, _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(code, mask_2), mask_2), _mm_srai_epi32(step, 1)));
+            diff = _mm_add_epi32(diff, _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(code, mask_1), mask_1), _mm_srai_epi32(step, 2)));
+            __m128i negative = _mm_cmpeq_epi32(_mm_and_si128(code, mask_8), mask_8);
+            diff = _mm_sub_epi32(_mm_xor_si128(diff, negative), negative);
+
+            // Saturate to 16 bits by packing, then sign extend back to 32 bits
+            __m128i sum = _mm_add_epi32(predictor, diff);
+            __m128i packed = _mm_packs_epi32(sum, sum);
+            predictor = _mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16);
+
+            // Index change is -1 for magnitudes 0-3, and (magnitude - 3) * 2 for 4-7
+            __m128i magnitude = _mm_and_si128(code, mask_7);
+            __m128i large = _mm_cmpgt_epi32(magnitude, three);
+            __m128i index_change = _mm_or_si128(
+                _mm_and_si128(large, _mm_slli_epi32(_mm_sub_epi32(magnitude, three), 1)),
+                _mm_andnot_si128(large, _mm_set1_epi32(-1)));
+            step_index = _mm_add_epi32(step_index, index_change);
+            step_index = _mm_and_si128(step_index, _mm_cmpgt_epi32(step_index, _mm_setzero_si128()));
+            __m128i too_large = _mm_cmpgt_epi32(step_index, max_index);
+            step_index = _mm_or_si128(_mm_andnot_si128(too_large, step_index), _mm_and_si128(too_large, max_index));
+
+            _mm_storeu_si128((__m128i*)predictors, predictor);
+            for (int lane = 0; lane < 4; ++lane) {
+                output[(b + lane) * IMA_ADPCM_BLOCK_SAMPLES + i] = (int16_t)predictors[lane];
+            }
+        }
+    }
+#endif
+    for (; b < n_blocks; ++b) {
+        ima_adpcm_decode_block(data + b * IMA_ADPCM_BLOCK_SIZE, output + b * IMA_ADPCM_BLOCK_SAMPLES);
+    }
+}
+
+// Reference decoder for one SPU-ADPCM block, like the SPU plays it. Returns the block's loop flags
+int spu_adpcm_decode_block(SpuAdpcmState* state, const uint8_t* block, int16_t* output) {
+    // Like the SPU, treat shift values 13-15 as 9, and clamp the filter to the ones that exist
+    int shift = block[0] & 0x0F;
+    int filter = (block[0] >> 4) & 0x07;
+    if (shift > 12) shift = 9;
+    if (filter > 4) filter = 4;
+
+    // Sign-extend every 4-bit code and scale it by the block's shift
+    int16_t scaled[32];
+#if defined(__SSE2__)
+    __m128i bytes = _mm_srli_si128(_mm_loadu_si128((const __m128i*)block), 2);
+    __m128i low = _mm_and_si128(bytes, _mm_set1_epi8(0x0F));
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0x0F));
+    __m128i codes_0 = _mm_unpacklo_epi8(low, high);     // Codes 0-15, one per byte
+    __m128i codes_1 = _mm_unpackhi_epi8(low, high);     // Codes 16-27
+    __m128i shift_count = _mm_cvtsi32_si128(shift);
+    __m128i nibble_shift = _mm_cvtsi32_si128(4);
+    // Putting the code in the top 4 bits of a 16-bit lane sign extends it, then an arithmetic shift scales it
+    _mm_storeu_si128((__m128i*)(scaled + 0), _mm_sra_epi16(_mm_unpacklo_epi8(_mm_setzero_si128(), _mm_sll_epi16(codes_0, nibble_shift)), shift_count));
+    _mm_storeu_si128((__m128i*)(scaled + 8), _mm_sra_epi16(_mm_unpackhi_epi8(_mm_setzero_si128(), _mm_sll_epi16(codes_0, nibble_shift)), shift_count));
+    _mm_storeu_si128((__m128i*)(scaled + 16), _mm_sra_epi16(_mm_unpacklo_epi8(_mm_setzero_si128(), _mm_sll_epi16(codes_1, nibble_shift)), shift_count));
+    _mm_storeu_si128((__m128i*)(scaled + 24), _mm_sra_epi16(_mm_unpackhi_epi8(_mm_setzero_si128(), _mm_sll_epi16(codes_1, nibble_shift)), shift_count));
+#else
+    for (int i = 0; i < SPU_ADPCM_BLOCK_SAMPLES; ++i) {
+        int code = (block[2 + (i >> 1)] >> ((i & 1) * 4)) & 0x0F;
+        scaled[i] = (int16_t)(code << 12) >> shift;
+    }
+#endif
+
+    // The prediction depends on the previous two outputs, so this part stays serial
+    int k1 = spu_adpcm_k1[filter];
+    int k2 = spu_adpcm_k2[filter];
+    int32_t prev1 = state->prev1;
+    int32_t prev2 = state->prev2;
+    for (int i = 0; i < SPU_ADPCM_BLOCK_SAMPLES; ++i) {
+        int32_t sample = scaled[i] + ((k1 * prev1 + k2 * prev2 + 32) >> 6);
+        if (sample > +0x7FFF) sample = +0x7FFF;
+        if (sample < -0x8000) sample = -0x8000;
+        output[i] = sample;
+        prev2 = prev1;
+        prev1 = sample;
+    }
+    state->prev1 = prev1;
+    state->prev2 = prev2;
+    return block[1];
+}
+#endif
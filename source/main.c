@@ -1,73 +1,304 @@
 #include "libpsxav.h"
 #include "wav.h"
+#include "merge.h"
+#include "soundbank.h"
+#include "patch.h"
+#include "spumap.h"
+#include "bankv2.h"
+#include "codec.h"
 #include <stdlib.h>
 
-typedef struct {
-    uint32_t sample_start;  // Offset (bytes) into sample data chunk. Can be written to SPU Sample Start Address
-    uint32_t sample_length; // Number of bytes in this sample. If `loop_start` is not equal to UINT32_MAX, this determines when to jump back to loop_start.
-    uint32_t sample_rate;   // Sample rate (Hz) at MIDI key 60 (C5)
-    uint32_t loop_start;    // Offset (bytes) relative to sample start to return to after the end of a sample. 
-    uint32_t format;        // 0 = PSX SPU-ADPCM, 1 = Signed little-endian 16-bit PCM
-} SampleHeader;
-
-typedef struct {
-    uint16_t sample_index;  // Index into sample header array
-    uint16_t delay;         // Delay stage length in milliseconds
-    uint16_t attack;        // Attack stage length in milliseconds
-    uint16_t hold;          // Hold stage length in milliseconds
-    uint16_t decay;         // Decay stage length in milliseconds
-    uint16_t sustain;       // Sustain volume where 0 = 0.0 and 65535 = 1.0
-    uint16_t release;       // Release stage length in milliseconds
-    uint16_t volume;        // Panning for this region, 0 = left, 127 = middle, 254 = right
-    uint16_t panning;       // Panning for this region, 0 = left, 127 = middle, 254 = right
-    uint8_t key_min;        // Minimum MIDI key for this instrument region
-    uint8_t key_max;        // Maximum MIDI key for this instrument region         
-} InstRegion;
+#define MAX_BANKS 16
+#define MAX_UPLOAD_CHUNK_SIZE (16 * CD_SECTOR_SIZE)
+#define DEFAULT_PSX_BUDGET (380 * 1024)
 
 typedef enum {
     FORMAT_PSX,
     FORMAT_PCM16,
+    FORMAT_IMA_ADPCM,
 } Format;
 
-int main(int argc, char** argv) {
-    // Validate input
-    if (argc != 4) {
-        printf("Usage: psx_soundfont_creator.exe <.csv> <.sbk> <format>\n");
-        exit(1);
+typedef struct {
+    unsigned int instrument_id;
+    unsigned int key_min;
+    unsigned int key_max;
+    unsigned int delay;
+    unsigned int attack;
+    unsigned int hold;
+    unsigned int decay;
+    unsigned int sustain;
+    unsigned int release;
+    unsigned int volume;
+    unsigned int panning;
+    char sample_source[128];
+    int channel;            // Channel to load from multi-channel samples, or WAV_CHANNEL_MIX to downmix them
+    int slice_start;        // First frame of the slice of the sample source to play, or -1 to play all of it
+    int slice_end;          // Frame after the slice, or -1 for the end of the sample source
+    int cue;                // Cue point the slice starts at, it ends at the next one. -1 if not used
+    WaveFile source;        // The whole sample source, if this entry plays a slice of it
+    WaveFile wave;          // What this entry plays: the whole sample source, or a slice of it
+    int merged;             // Set when this region was folded into a neighbouring region and its sample dropped
+    int sample;             // Index into the sample pool
+} BankEntry;
+
+// A piece of a bank's sample data that is contiguous in SPU RAM
+typedef struct {
+    uint32_t spu_start;     // Where it goes in SPU RAM, same base as SampleHeader.sample_start
+    uint32_t size;
+} DataExtent;
+
+typedef struct {
+    const char* def_path;   // Soundbank definition (.csv)
+    const char* out_path;   // Soundbank output (.sbk)
+    BankEntry* entries;
+    int n_entries;
+    uint32_t data_offset;   // Where this bank's sample data chunk starts, relative to the base bank's
+    uint32_t data_size;
+    DataExtent extents[SPU_MAP_MAX_SPANS];      // Without an SPU memory map, the whole chunk is one extent at data_offset
+    int n_extents;
+} Bank;
+
+typedef struct {
+    const char* name;
+    WaveFile wave;
+    int bank;               // Bank whose sample data holds this sample. Samples used by several banks move to the base bank (0)
+    int index;              // Index into the sample header array of that bank, -1 for slice sources
+    int is_slice_source;    // Holds the encoded slices of `wave`, but isn't played itself and has no header
+    int parent;             // Slice source whose data holds this slice, or -1 if the sample has data of its own
+    int slice_start;        // First frame of the slice in the parent's wave
+    uint32_t parent_offset; // Offset (bytes) of the slice's data in the parent's data
+    uint8_t* data;          // Encoded sample data, NULL for slices
+    size_t data_size;       // For slices, the size of the slice's part of the parent's data
+    SampleHeader header;
+} PoolSample;
+
+// Number of bytes a sample will take up in the sample data chunk, including alignment
+static size_t get_encoded_size(Format format, const WaveFile* wave) {
+    size_t size = 0;
+    if (format == FORMAT_PSX) {
+        size = psx_audio_spu_get_buffer_size((wave->loop_end != -1) ? (wave->loop_end + 1) : wave->length);
     }
-    const char* path = argv[1];
-    const char* out_path = argv[2];
-    const char* format_str = argv[3];
+    else if (format == FORMAT_PCM16) {
+        size = wave->length * sizeof(int16_t);
+    }
+    else if (format == FORMAT_IMA_ADPCM) {
+        size = ima_adpcm_get_buffer_size((wave->loop_end != -1) ? (wave->loop_end + 1) : wave->length);
+    }
+    return (size + 15) & ~15;
+}
 
-    // Parse format
-    size_t available_space = 0;
-    Format format;
-    if (strcmp(format_str, "psx") == 0) {
-        // The PS1 has 512 KB of sound RAM, I allocate 380 KB for music instruments
-        format = FORMAT_PSX;
-        available_space = 380 * 1024;
+// Samples are shared by content rather than by file name, so copies of the same file in different folders are caught as well
+static int same_wave(const WaveFile* a, const WaveFile* b) {
+    return a->sample_rate == b->sample_rate
+        && a->length == b->length
+        && a->loop_start == b->loop_start
+        && a->loop_end == b->loop_end
+        && a->samples != NULL
+        && b->samples != NULL
+        && memcmp(a->samples, b->samples, a->length * sizeof(int16_t)) == 0;
+}
+
+// Regions can only be merged if the only thing that differs between them is the sample and key range
+static int same_articulation(const BankEntry* a, const BankEntry* b) {
+    return a->delay == b->delay
+        && a->attack == b->attack
+        && a->hold == b->hold
+        && a->decay == b->decay
+        && a->sustain == b->sustain
+        && a->release == b->release
+        && a->volume == b->volume
+        && a->panning == b->panning
+        && (a->wave.loop_start < 0) == (b->wave.loop_start < 0);
+}
+
+// Finds chains of adjacent regions whose samples sound alike within `tolerance_db`, and if `apply` is set,
+// widens the lowest region of each chain over the others and drops their samples. Returns the bytes saved.
+static size_t merge_similar_regions(BankEntry* entries, int n_entries, Format format, float tolerance_db, int apply) {
+    Spectrum* spectra = malloc(n_entries * sizeof(Spectrum));
+    for (int i = 0; i < n_entries; ++i) {
+        if (entries[i].wave.samples != NULL) {
+            compute_spectrum(&entries[i].wave, &spectra[i]);
+        }
     }
-    else if (strcmp(format_str, "pcm16") == 0) {
-        format = FORMAT_PCM16;
-        available_space = 256 * 1024 * 1024;
+
+    int* dropped = calloc(n_entries, sizeof(int));
+    int n_merged = 0;
+    for (int instrument_id = 0; instrument_id < 256; ++instrument_id) {
+        // Gather this instrument's regions, sorted by key
+        int sorted[1024];
+        int n_sorted = 0;
+        for (int i = 0; i < n_entries; ++i) {
+            if ((int)entries[i].instrument_id != instrument_id || entries[i].wave.samples == NULL) {
+                continue;
+            }
+            int j = n_sorted++;
+            while (j > 0 && entries[sorted[j - 1]].key_min > entries[i].key_min) {
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j] = i;
+        }
+
+        // Always compare against the region that will survive, so errors don't accumulate along a chain
+        int survivor = 0;
+        unsigned int chain_key_max = 0;
+        for (int i = 0; i < n_sorted; ++i) {
+            BankEntry* entry = &entries[sorted[i]];
+            if (i > 0 && entry->key_min == chain_key_max + 1 && same_articulation(&entries[survivor], entry)) {
+                float distance = spectral_distance(&spectra[survivor], &spectra[sorted[i]]);
+                if (distance <= tolerance_db) {
+                    printf("Instrument %i: %s keys %i-%i from '%s' into '%s' (%.2f dB)\n",
+                        instrument_id, apply ? "merged" : "can merge", entry->key_min, entry->key_max,
+                        entry->sample_source, entries[survivor].sample_source, distance);
+                    chain_key_max = entry->key_max;
+                    dropped[sorted[i]] = 1;
+                    n_merged++;
+                    if (apply) {
+                        entries[survivor].key_max = entry->key_max;
+                        entry->merged = 1;
+                    }
+                    continue;
+                }
+            }
+            survivor = sorted[i];
+            chain_key_max = entry->key_max;
+        }
     }
 
-    uint8_t* scratch_buffer = malloc(available_space);
-    uint8_t* sample_stack = malloc(available_space);
-    uint8_t* sample_stack_cursor = &sample_stack[0];
-    uint32_t sample_offsets[1024] = {0};
-    char* sample_names[1024] = { 0 };
-    InstRegion inst_regions[1024];
-    SampleHeader sample_headers[1024];
-    int size_left = available_space;
-    uint32_t n_samples = 0;
-    uint16_t region_indices_per_instrument[256][16] = { 0 };
-    uint16_t region_count_per_instrument[256] = { 0 };
+    // A dropped region's sample is only saved if no remaining region plays it. Count every sample once
+    size_t bytes_saved = 0;
+    for (int i = 0; i < n_entries; ++i) {
+        if (!dropped[i])
+            continue;
+        int still_used = 0;
+        for (int j = 0; j < n_entries && !still_used; ++j) {
+            if (!dropped[j] || j < i) {
+                still_used = same_wave(&entries[j].wave, &entries[i].wave);
+            }
+        }
+        if (!still_used) {
+            bytes_saved += get_encoded_size(format, &entries[i].wave);
+        }
+    }
+
+    printf("%s %i regions, saving %zu bytes of sample data\n", apply ? "Merged" : "Merging would drop", n_merged, bytes_saved);
+    free(dropped);
+    free(spectra);
+    return bytes_saved;
+}
+
+// Parses a frame number, cue id or channel. Returns 0 if it isn't a non-negative number
+static int parse_frame_number(const char* value, int* number) {
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    while (*end == ' ' || *end == '\t') {
+        end++;
+    }
+    if (end == value || *end != 0 || parsed < 0 || parsed > INT32_MAX) {
+        return 0;
+    }
+    *number = (int)parsed;
+    return 1;
+}
+
+// Parses the optional `key=value` fields after the sample source, e.g. "piano.wav;channel=left" or "kit.wav;start=0;end=4410".
+// Returns 0 if a slice option is invalid
+static int parse_entry_options(const char* options, BankEntry* instrument_info) {
+    while (*options == ';') {
+        char key[32] = { 0 };
+        char value[96] = { 0 };
+        int length = 0;
+        sscanf(options, ";%31[^=;\r\n]%n", key, &length);
+        if (length == 0) {
+            break;
+        }
+        options += length;
+        if (*options == '=') {
+            length = 0;
+            sscanf(options, "=%95[^;\r\n]%n", value, &length);
+            options += (length > 0) ? length : 1;
+        }
+
+        int* slice_field = NULL;
+        if (strcmp(key, "start") == 0) slice_field = &instrument_info->slice_start;
+        else if (strcmp(key, "end") == 0) slice_field = &instrument_info->slice_end;
+        else if (strcmp(key, "cue") == 0) slice_field = &instrument_info->cue;
+        if (slice_field != NULL && !parse_frame_number(value, slice_field)) {
+            printf("Invalid %s '%s' for sample '%s'\n", key, value, instrument_info->sample_source);
+            return 0;
+        }
+
+        if (strcmp(key, "channel") == 0) {
+            if (strcmp(value, "mix") == 0) instrument_info->channel = WAV_CHANNEL_MIX;
+            else if (strcmp(value, "left") == 0) instrument_info->channel = 0;
+            else if (strcmp(value, "right") == 0) instrument_info->channel = 1;
+            else if (!parse_frame_number(value, &instrument_info->channel)) {
+                printf("Invalid channel '%s' for sample '%s'\n", value, instrument_info->sample_source);
+                return 0;
+            }
+        }
+        else if (slice_field == NULL) {
+            printf("Unknown option '%s' for sample '%s'\n", key, instrument_info->sample_source);
+        }
+    }
+    return 1;
+}
 
+// Turns an entry's wave into the slice of the sample source it refers to. Slices are always played as one-shots.
+// Returns 0 if the slice doesn't exist
+static int slice_entry(BankEntry* instrument_info) {
+    WaveFile source = instrument_info->wave;
+    if (source.samples == NULL) {
+        return 1;
+    }
+
+    int start = (instrument_info->slice_start >= 0) ? instrument_info->slice_start : 0;
+    int end = (instrument_info->slice_end >= 0) ? instrument_info->slice_end : source.length;
+    if (instrument_info->cue >= 0) {
+        int cue = 0;
+        while (cue < source.n_cues && source.cues[cue].id != (uint32_t)instrument_info->cue) {
+            cue++;
+        }
+        if (cue == source.n_cues) {
+            printf("Sample '%s' has no cue point %i\n", instrument_info->sample_source, instrument_info->cue);
+            return 0;
+        }
+
+        // The slice runs up to the next cue point
+        start = source.cues[cue].position;
+        end = source.length;
+        for (int i = 0; i < source.n_cues; ++i) {
+            if ((int)source.cues[i].position > start && (int)source.cues[i].position < end) {
+                end = source.cues[i].position;
+            }
+        }
+    }
+    if (end > source.length) {
+        end = source.length;
+    }
+    if (start >= end) {
+        printf("Slice %i-%i of sample '%s' is empty\n", start, end, instrument_info->sample_source);
+        return 0;
+    }
+
+    instrument_info->source = source;
+    instrument_info->slice_start = start;
+    instrument_info->slice_end = end;
+    instrument_info->wave.samples = source.samples + start;
+    instrument_info->wave.length = end - start;
+    instrument_info->wave.loop_start = -1;
+    instrument_info->wave.loop_end = -1;
+    return 1;
+}
+
+// Reads a soundbank definition file and loads all the samples it refers to. Returns the number of entries, or -1 if
+// an entry refers to a slice that doesn't exist
+static int load_bank_definition(const char* path, BankEntry* entries, int dither) {
     // Open the soundbank definition file
     FILE* sbk_def_file = fopen(path, "r");
     if (sbk_def_file == NULL) {
         printf("Failed to open file '%s'\n", path);
+        return 0;
     }
 
     // Find file path from input
@@ -85,6 +316,8 @@ int main(int argc, char** argv) {
     folder[last_slash_index + 1] = 0;
 
     // Loop over all the entries in the file
+    int n_entries = 0;
+    int failed = 0;
     while(1)
     {
         // Read a line
@@ -97,151 +330,607 @@ int main(int argc, char** argv) {
             continue;
 
         // Parse data
-        struct {
-            unsigned int instrument_id;
-            unsigned int key_min;
-            unsigned int key_max;
-            unsigned int delay;
-            unsigned int attack;
-            unsigned int hold;
-            unsigned int decay;
-            unsigned int sustain;
-            unsigned int release;
-            unsigned int volume;
-            unsigned int panning;
-            char sample_source[128];
-        } instrument_info;
-        sscanf(line, "%i;%i;%i;%i;%i;%i;%i;%i;%i;%i;%i;%s",
-            &instrument_info.instrument_id,
-            &instrument_info.key_min,
-            &instrument_info.key_max,
-            &instrument_info.delay,
-            &instrument_info.attack,
-            &instrument_info.hold,
-            &instrument_info.decay,
-            &instrument_info.sustain,
-            &instrument_info.release,
-            &instrument_info.volume,
-            &instrument_info.panning,
-            instrument_info.sample_source
+        BankEntry* instrument_info = &entries[n_entries++];
+        int length_fields = 0;
+        sscanf(line, "%i;%i;%i;%i;%i;%i;%i;%i;%i;%i;%i;%127[^;\r\n]%n",
+            &instrument_info->instrument_id,
+            &instrument_info->key_min,
+            &instrument_info->key_max,
+            &instrument_info->delay,
+            &instrument_info->attack,
+            &instrument_info->hold,
+            &instrument_info->decay,
+            &instrument_info->sustain,
+            &instrument_info->release,
+            &instrument_info->volume,
+            &instrument_info->panning,
+            instrument_info->sample_source,
+            &length_fields
         );
 
-        // Align to 16 bytes - should be unnecessary but you never know
-        while (size_left % 16 != 0) {
-            sample_stack_cursor++;
-            size_left--;
+        // Anything after the sample source is optional
+        size_t length_sample_source = strlen(instrument_info->sample_source);
+        while (length_sample_source > 0 && (instrument_info->sample_source[length_sample_source - 1] == ' ' || instrument_info->sample_source[length_sample_source - 1] == '\t')) {
+            instrument_info->sample_source[--length_sample_source] = 0;
+        }
+        instrument_info->channel = WAV_CHANNEL_MIX;
+        instrument_info->slice_start = -1;
+        instrument_info->slice_end = -1;
+        instrument_info->cue = -1;
+        if (length_fields > 0 && !parse_entry_options(line + length_fields, instrument_info)) {
+            failed = 1;
+            continue;
         }
 
-        // Find wave sample path
-        size_t length_sample_source = strlen(instrument_info.sample_source);
-        char* sample_path = malloc(strlen(folder) + length_sample_source + 1);
-        memcpy(sample_path, folder, last_slash_index + 1);
-        memcpy(sample_path + last_slash_index + 1, instrument_info.sample_source, length_sample_source + 1);
+        // Slices of one sample source are usually listed together, only load it once
+        int previous = 0;
+        while (previous < n_entries - 1 && (strcmp(entries[previous].sample_source, instrument_info->sample_source) != 0 || entries[previous].channel != instrument_info->channel)) {
+            previous++;
+        }
+        if (previous < n_entries - 1) {
+            instrument_info->wave = (entries[previous].source.samples != NULL) ? entries[previous].source : entries[previous].wave;
+        }
+        else {
+            // Find wave sample path
+            char* sample_path = malloc(strlen(folder) + length_sample_source + 1);
+            memcpy(sample_path, folder, last_slash_index + 1);
+            memcpy(sample_path + last_slash_index + 1, instrument_info->sample_source, length_sample_source + 1);
 
-        // Load and convert the wave file
-        WaveFile wave = load_wav(sample_path);
-        int sample_length;
-        if (wave.loop_end != -1) sample_length = wave.loop_end + 1;
-        else sample_length = wave.length;
+            // Load the wave or AIFF file
+            instrument_info->wave = load_sample(sample_path, instrument_info->channel, dither);
+            free(sample_path);
+            if (instrument_info->wave.samples == NULL && instrument_info->wave.num_channels > 0 && instrument_info->channel >= instrument_info->wave.num_channels) {
+                printf("Invalid channel %i for sample '%s', it has %i channels\n", instrument_info->channel, instrument_info->sample_source, instrument_info->wave.num_channels);
+                failed = 1;
+            }
+        }
+
+        if (instrument_info->cue >= 0 || instrument_info->slice_start >= 0 || instrument_info->slice_end >= 0) {
+            failed |= !slice_entry(instrument_info);
+        }
+    }
+
+    fclose(sbk_def_file);
+    free(folder);
+    return failed ? -1 : n_entries;
+}
 
-        int spu_sample_length = -1;
-        size_t size_of_sample = 0;
+// Encodes a sample into its final format and fills in everything in its header except the start offset
+static void encode_sample(PoolSample* sample, Format format) {
+    WaveFile wave = sample->wave;
+    int sample_length;
+    if (wave.loop_end != -1) sample_length = wave.loop_end + 1;
+    else sample_length = wave.length;
+
+    int spu_sample_length = -1;
+    size_t size_of_sample = 0;
+    if (format == FORMAT_PSX) {
+        sample->data = malloc(psx_audio_spu_get_buffer_size(sample_length));
+        spu_sample_length = psx_audio_spu_encode_simple(wave.samples, sample_length, sample->data, wave.loop_start);
+        size_of_sample = 1;
+    }
+    else if (format == FORMAT_PCM16) {
+        size_of_sample = sizeof(int16_t);
+        spu_sample_length = wave.length * size_of_sample;
+        sample->data = malloc(spu_sample_length);
+        memcpy(sample->data, wave.samples, spu_sample_length);
+    }
+    else if (format == FORMAT_IMA_ADPCM) {
+        sample->data = malloc(ima_adpcm_get_buffer_size(sample_length));
+        spu_sample_length = ima_adpcm_encode(wave.samples, sample_length, sample->data);
+        size_of_sample = 1;
+    }
+    sample->data_size = spu_sample_length;
+
+    sample->header.format = format;
+    sample->header.sample_rate = wave.sample_rate;
+    sample->header.loop_start = wave.loop_start * size_of_sample;
+    sample->header.sample_length = ((wave.loop_start < 0) ? (wave.length) : (wave.loop_end)) * size_of_sample;
+}
+
+static uint32_t align_up(uint32_t value, uint32_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Encodes all slices of a sample source into one piece of data. The source is encoded once, and every slice points
+// straight into it, at the start of the block its first frame is in, so a slice can start up to one block early. Runs
+// of slices that touch or overlap are stored once, gaps between them are left out. SPU-ADPCM slices end on their own
+// end flag, and start on a block encoded with a reset predictor, like the SPU at key on. A slice that overlaps the one
+// before it can't share that end flag, so it is encoded again after the shared data
+static void encode_slices(PoolSample* pool, int n_pool_samples, int source, Format format) {
+    int* order = malloc(n_pool_samples * sizeof(int));
+    int n_slices = 0;
+    for (int i = 0; i < n_pool_samples; ++i) {
+        if (pool[i].parent != source)
+            continue;
+        int j = n_slices++;
+        while (j > 0 && pool[order[j - 1]].slice_start > pool[i].slice_start) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    int block_frames = 1;
+    uint32_t block_size = sizeof(int16_t);
+    size_t size_of_sample = sizeof(int16_t);
+    if (format == FORMAT_PSX) {
+        block_frames = 28;
+        block_size = 16;
+        size_of_sample = 1;
+    }
+    else if (format == FORMAT_IMA_ADPCM) {
+        block_frames = IMA_ADPCM_BLOCK_SAMPLES;
+        block_size = IMA_ADPCM_BLOCK_SIZE;
+        size_of_sample = 1;
+    }
+
+    // The blocks of the source every slice plays, end exclusive
+    int* first_blocks = malloc(n_slices * sizeof(int));
+    int* end_blocks = malloc(n_slices * sizeof(int));
+    int* shared = malloc(n_slices * sizeof(int));
+    size_t size = 0;
+    for (int i = 0; i < n_slices; ++i) {
+        const PoolSample* slice = &pool[order[i]];
+        first_blocks[i] = slice->slice_start / block_frames;
+        end_blocks[i] = (slice->slice_start + slice->wave.length + block_frames - 1) / block_frames;
+        shared[i] = 1;
+        size += (end_blocks[i] - first_blocks[i]) * block_size + 16;
+    }
+
+    // An SPU-ADPCM slice stops at the first end flag, so slices that share data can't overlap. When a slice only
+    // reaches into the block the next one starts in, it ends a block early instead, on the next slice's first block
+    if (format == FORMAT_PSX) {
+        int previous = -1;
+        for (int i = 0; i < n_slices; ++i) {
+            if (previous >= 0 && end_blocks[previous] > first_blocks[i]) {
+                const PoolSample* slice = &pool[order[previous]];
+                if (slice->slice_start + slice->wave.length > pool[order[i]].slice_start || first_blocks[i] == first_blocks[previous]) {
+                    shared[i] = 0;
+                    continue;
+                }
+                end_blocks[previous] = first_blocks[i];
+            }
+            previous = i;
+        }
+    }
+
+    PoolSample* parent = &pool[source];
+    parent->data = calloc(size + 1, 1);
+    parent->data_size = 0;
+    int run_start = 0;
+    while (run_start < n_slices) {
+        if (!shared[run_start]) {
+            run_start++;
+            continue;
+        }
+
+        // Gather the slices whose blocks touch or overlap
+        int run_end = run_start + 1;
+        int run_first_block = first_blocks[run_start];
+        int run_end_block = end_blocks[run_start];
+        while (run_end < n_slices && (!shared[run_end] || first_blocks[run_end] <= run_end_block)) {
+            if (shared[run_end] && end_blocks[run_end] > run_end_block) {
+                run_end_block = end_blocks[run_end];
+            }
+            run_end++;
+        }
+
+        // Encode the run once
+        uint8_t* run_data = parent->data + parent->data_size;
+        int run_first_frame = run_first_block * block_frames;
+        int run_end_frame = run_end_block * block_frames;
+        if (run_end_frame > parent->wave.length) {
+            run_end_frame = parent->wave.length;
+        }
         if (format == FORMAT_PSX) {
-            spu_sample_length = psx_audio_spu_encode_simple(wave.samples, sample_length, scratch_buffer, wave.loop_start);
-            size_of_sample = 1;
+            // One piece per slice, each with a fresh predictor
+            for (int i = run_start; i < run_end; ++i) {
+                if (!shared[i])
+                    continue;
+                int start = first_blocks[i] * block_frames;
+                int end = (end_blocks[i] * block_frames < parent->wave.length) ? end_blocks[i] * block_frames : parent->wave.length;
+                psx_audio_encoder_channel_state_t state;
+                memset(&state, 0, sizeof(state));
+                uint8_t* slice_data = run_data + (first_blocks[i] - run_first_block) * block_size;
+                int length = psx_audio_spu_encode(&state, parent->wave.samples + start, end - start, 1, slice_data);
+                slice_data[length - 16 + 1] = PSX_AUDIO_SPU_LOOP_END;
+            }
         }
         else if (format == FORMAT_PCM16) {
-            size_of_sample = sizeof(int16_t);
-            spu_sample_length = wave.length * size_of_sample;
-            memcpy(scratch_buffer, wave.samples, spu_sample_length);
-        }
-
-        // If the data fits, copy it over, and add it to the list
-        if (spu_sample_length <= size_left) {
-            // Sample data
-            memcpy(sample_stack_cursor, scratch_buffer, spu_sample_length);
-
-            // Sample name
-            sample_names[n_samples] = malloc(length_sample_source + 1);
-            memcpy(sample_names[n_samples], instrument_info.sample_source, length_sample_source + 1);
-
-            // Sample offset
-            sample_offsets[n_samples] = sample_stack_cursor - sample_stack;
-
-            // Sample header
-            sample_headers[n_samples].format = format;
-            sample_headers[n_samples].sample_start = sample_offsets[n_samples];
-            sample_headers[n_samples].sample_rate = wave.sample_rate;
-            sample_headers[n_samples].loop_start = wave.loop_start * size_of_sample;
-            sample_headers[n_samples].sample_length = ((wave.loop_start < 0) ? (wave.length) : (wave.loop_end)) * size_of_sample;
-
-            // Instrument region
-            inst_regions[n_samples] = (InstRegion){
-                .sample_index = n_samples,
-                .key_min      = instrument_info.key_min,
-                .key_max      = instrument_info.key_max,
-                .delay        = instrument_info.delay,
-                .attack       = instrument_info.attack,
-                .hold         = instrument_info.hold,
-                .decay        = instrument_info.decay,
-                .sustain      = instrument_info.sustain,
-                .release      = instrument_info.release,
-                .volume       = instrument_info.volume,
-                .panning      = instrument_info.panning,
-            };
+            memcpy(run_data, parent->wave.samples + run_first_frame, (run_end_frame - run_first_frame) * sizeof(int16_t));
+        }
+        else if (format == FORMAT_IMA_ADPCM) {
+            ima_adpcm_encode(parent->wave.samples + run_first_frame, run_end_frame - run_first_frame, run_data);
+        }
 
-            // Update instrument
-            uint16_t* curr_index = &region_count_per_instrument[instrument_info.instrument_id];
-            region_indices_per_instrument[instrument_info.instrument_id][*curr_index] = n_samples;
-            *curr_index += 1;
+        for (int i = run_start; i < run_end; ++i) {
+            if (!shared[i])
+                continue;
+            PoolSample* slice = &pool[order[i]];
+            int start = first_blocks[i] * block_frames;
+            int end = slice->slice_start + slice->wave.length;
+            if (end > end_blocks[i] * block_frames) {
+                end = end_blocks[i] * block_frames;
+            }
+            slice->parent_offset = parent->data_size + (first_blocks[i] - run_first_block) * block_size;
+            slice->data_size = (format == FORMAT_PCM16) ? (end - start) * sizeof(int16_t) : (end_blocks[i] - first_blocks[i]) * block_size;
+            slice->header.format = format;
+            slice->header.sample_rate = slice->wave.sample_rate;
+            slice->header.loop_start = UINT32_MAX;
+            slice->header.sample_length = (end - start) * size_of_sample;
+        }
+        parent->data_size += align_up((format == FORMAT_PCM16) ? (run_end_frame - run_first_frame) * sizeof(int16_t) : (run_end_block - run_first_block) * block_size, 16);
+        run_start = run_end;
+    }
+
+    // Slices that couldn't share get their own copy
+    for (int i = 0; i < n_slices; ++i) {
+        if (shared[i])
+            continue;
+        PoolSample* slice = &pool[order[i]];
+        encode_sample(slice, format);
+        slice->parent_offset = parent->data_size;
+        memcpy(parent->data + parent->data_size, slice->data, slice->data_size);
+        parent->data_size += align_up(slice->data_size, 16);
+        free(slice->data);
+        slice->data = NULL;
+    }
+    free(first_blocks);
+    free(end_blocks);
+    free(shared);
+    free(order);
+}
+
+// Places every bank's samples at absolute addresses in the free spans of SPU RAM, first fit, largest samples first,
+// base bank first. The dependent banks are alternatives that are loaded one at a time, so each of them starts right
+// after the base bank. A sample never straddles a reserved region. A bank's samples in one span form one extent, which
+// is rounded up to whole DMA blocks so its upload can't clobber the next bank. Returns the number of bytes that didn't fit
+static size_t place_samples(Bank* banks, int n_banks, PoolSample* pool, int n_pool_samples, const SpuRegion* spans, int n_spans) {
+    uint32_t cursors[SPU_MAP_MAX_SPANS];
+    for (int s = 0; s < n_spans; ++s) {
+        cursors[s] = spans[s].start;
+    }
+
+    int* order = malloc(n_pool_samples * sizeof(int));
+    size_t size_left_over = 0;
+    uint32_t base_cursors[SPU_MAP_MAX_SPANS];
+    for (int b = 0; b < n_banks; ++b) {
+        if (b > 0) {
+            memcpy(cursors, base_cursors, n_spans * sizeof(uint32_t));
+        }
 
-            // Move to next sample
-            n_samples++;
+        // Sort this bank's samples by size, biggest first
+        int n_order = 0;
+        for (int i = 0; i < n_pool_samples; ++i) {
+            if (pool[i].bank != b || pool[i].parent >= 0)
+                continue;
+            int j = n_order++;
+            while (j > 0 && pool[order[j - 1]].data_size < pool[i].data_size) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
         }
 
-        // If out of memory, still keep track of how big it is. This way the user can figure out how much data to shave off
-        sample_stack_cursor += spu_sample_length;
-        size_left -= spu_sample_length;
+        uint32_t bank_starts[SPU_MAP_MAX_SPANS];
+        memcpy(bank_starts, cursors, n_spans * sizeof(uint32_t));
+        for (int o = 0; o < n_order; ++o) {
+            PoolSample* sample = &pool[order[o]];
+            int s = 0;
+            while (s < n_spans && align_up(cursors[s], 16) + sample->data_size > spans[s].end) {
+                s++;
+            }
+            if (s == n_spans) {
+                size_left_over += align_up(sample->data_size, 16);
+                continue;
+            }
+            sample->header.sample_start = align_up(cursors[s], 16);
+            cursors[s] = sample->header.sample_start + sample->data_size;
+        }
+
+        banks[b].n_extents = 0;
+        banks[b].data_size = 0;
+        for (int s = 0; s < n_spans; ++s) {
+            if (cursors[s] == bank_starts[s])
+                continue;
+            cursors[s] = align_up(cursors[s], DMA_BLOCK_SIZE);
+            banks[b].extents[banks[b].n_extents++] = (DataExtent){ .spu_start = bank_starts[s], .size = cursors[s] - bank_starts[s] };
+            banks[b].data_size += cursors[s] - bank_starts[s];
+        }
+        if (b == 0) {
+            memcpy(base_cursors, cursors, n_spans * sizeof(uint32_t));
+        }
     }
+    free(order);
+    return size_left_over;
+}
 
-    // Notify the user if we run out of RAM, might be nice for them to know.
-    if (size_left < 0) {
-        printf("Out of Sound RAM! Try downsampling or cutting the samples shorter\n");
-        printf("Amount of bytes to reduce: %i\n", -size_left);
-        return 1;
+// Finds where the sample data at `address` is stored in a previous build of a bank. Returns NULL if it isn't in there
+static const uint8_t* find_previous_data(const Soundbank* previous, const uint8_t* file, uint32_t file_size, uint32_t address, uint32_t size) {
+    uint32_t file_offset = (uint32_t)(previous->sample_data - file) + address;
+    if (previous->chunk_table != NULL) {
+        uint32_t i = 0;
+        while (i < previous->chunk_table->n_chunks && (address < previous->chunks[i].spu_offset || address >= previous->chunks[i].spu_offset + previous->chunks[i].size)) {
+            i++;
+        }
+        if (i == previous->chunk_table->n_chunks) {
+            return NULL;
+        }
+        file_offset = previous->chunks[i].file_offset + (address - previous->chunks[i].spu_offset);
+    }
+    if (file_offset > file_size || size > file_size - file_offset) {
+        return NULL;
+    }
+    return file + file_offset;
+}
+
+static int overlaps_placed(const PoolSample* pool, const int* placed, int n_placed, uint32_t start, uint32_t size) {
+    for (int i = 0; i < n_placed; ++i) {
+        const PoolSample* other = &pool[placed[i]];
+        if (start < other->header.sample_start + other->data_size && other->header.sample_start < start + size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Lays out a single bank so that every sample that is unchanged since the previous build stays where it was. The
+// other samples go first fit, largest first, into the gaps that are left, so a patch between the two builds only has
+// to touch the samples that changed. `spans` are the parts of sample RAM the bank may use. If `absolute` is set, the
+// bank is placed with an SPU memory map. Returns the number of bytes that didn't fit
+static size_t place_samples_stable(Bank* bank, PoolSample* pool, int n_pool_samples, const uint8_t* previous_file, uint32_t previous_size, const SpuRegion* spans, int n_spans, int absolute) {
+    // Sample starts of a bank placed with a memory map and one without don't mean the same thing
+    Soundbank previous;
+    if (!parse_soundbank(previous_file, previous_size, &previous)
+        || absolute != (previous.chunk_table != NULL && (previous.chunk_table->flags & UPLOAD_CHUNKS_ABSOLUTE))) {
+        memset(&previous, 0, sizeof(previous));
+    }
+
+    int* placed = malloc(n_pool_samples * sizeof(int));
+    int n_placed = 0;
+    int* order = malloc(n_pool_samples * sizeof(int));
+    int n_order = 0;
+    for (int i = 0; i < n_pool_samples; ++i) {
+        if (pool[i].parent >= 0)
+            continue;
+
+        // Every sample's data starts at the sample start of one of the previous build's sample headers
+        int kept = 0;
+        for (uint32_t h = 0; h < previous.header.n_samples && !kept; ++h) {
+            uint32_t start = previous.sample_headers[h].sample_start;
+            const uint8_t* data = find_previous_data(&previous, previous_file, previous_size, start, pool[i].data_size);
+            int s = 0;
+            while (s < n_spans && (start < spans[s].start || start + pool[i].data_size > spans[s].end)) {
+                s++;
+            }
+            if (data != NULL && s < n_spans && start % 16 == 0 && memcmp(data, pool[i].data, pool[i].data_size) == 0
+                && !overlaps_placed(pool, placed, n_placed, start, pool[i].data_size)) {
+                pool[i].header.sample_start = start;
+                placed[n_placed++] = i;
+                kept = 1;
+            }
+        }
+        if (kept)
+            continue;
+
+        // Sort the others by size, biggest first
+        int j = n_order++;
+        while (j > 0 && pool[order[j - 1]].data_size < pool[i].data_size) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    // A sample can go at the start of a span, or right after any sample that has been placed
+    size_t size_left_over = 0;
+    for (int o = 0; o < n_order; ++o) {
+        PoolSample* sample = &pool[order[o]];
+        uint32_t best = UINT32_MAX;
+        for (int s = 0; s < n_spans; ++s) {
+            for (int c = -1; c < n_placed; ++c) {
+                uint32_t candidate = (c < 0) ? spans[s].start : align_up(pool[placed[c]].header.sample_start + pool[placed[c]].data_size, 16);
+                if (candidate >= spans[s].start && candidate + sample->data_size <= spans[s].end && candidate < best
+                    && !overlaps_placed(pool, placed, n_placed, candidate, sample->data_size)) {
+                    best = candidate;
+                }
+            }
+        }
+        if (best == UINT32_MAX) {
+            size_left_over += align_up(sample->data_size, 16);
+            continue;
+        }
+        sample->header.sample_start = best;
+        placed[n_placed++] = order[o];
+    }
+
+    // The bank's samples in one span form one extent, which starts at the start of the span
+    bank->n_extents = 0;
+    bank->data_size = 0;
+    for (int s = 0; s < n_spans; ++s) {
+        uint32_t end = spans[s].start;
+        for (int i = 0; i < n_placed; ++i) {
+            uint32_t sample_end = pool[placed[i]].header.sample_start + pool[placed[i]].data_size;
+            if (pool[placed[i]].header.sample_start >= spans[s].start && sample_end <= spans[s].end && sample_end > end) {
+                end = sample_end;
+            }
+        }
+        if (end == spans[s].start)
+            continue;
+        end = absolute ? align_up(end, DMA_BLOCK_SIZE) : end;
+        bank->extents[bank->n_extents++] = (DataExtent){ .spu_start = spans[s].start, .size = end - spans[s].start };
+        bank->data_size += end - spans[s].start;
+    }
+    free(order);
+    free(placed);
+    return size_left_over;
+}
+
+// Shows what is reserved in SPU RAM and where every bank ended up
+static void print_spu_map(const SpuMap* map, const SpuRegion* spans, int n_spans, const Bank* banks, int n_banks) {
+    // Print everything in address order
+    SpuRegion* lines = malloc((map->n_reserved + MAX_BANKS * SPU_MAP_MAX_SPANS) * sizeof(SpuRegion));
+    int n_lines = 0;
+    for (int i = 0; i < map->n_reserved; ++i) {
+        lines[n_lines++] = map->reserved[i];
+    }
+    for (int b = 0; b < n_banks; ++b) {
+        for (int e = 0; e < banks[b].n_extents; ++e) {
+            SpuRegion* line = &lines[n_lines++];
+            line->start = banks[b].extents[e].spu_start;
+            line->end = banks[b].extents[e].spu_start + banks[b].extents[e].size;
+            snprintf(line->name, sizeof(line->name), "%s", banks[b].out_path);
+        }
+    }
+    for (int i = 1; i < n_lines; ++i) {
+        for (int j = i; j > 0 && lines[j - 1].start > lines[j].start; --j) {
+            SpuRegion t = lines[j]; lines[j] = lines[j - 1]; lines[j - 1] = t;
+        }
+    }
+    printf("SPU RAM map:\n");
+    for (int i = 0; i < n_lines; ++i) {
+        printf("    0x%05X-0x%05X %7u bytes  %s\n", lines[i].start, lines[i].end, lines[i].end - lines[i].start, lines[i].name);
+    }
+    free(lines);
+
+    uint32_t size_free = 0;
+    uint32_t size_used = 0;
+    for (int s = 0; s < n_spans; ++s) {
+        size_free += spans[s].end - spans[s].start;
+    }
+    // Only one dependent bank is loaded at a time, so the largest one counts
+    for (int b = 1; b < n_banks; ++b) {
+        if (banks[b].data_size > size_used) {
+            size_used = banks[b].data_size;
+        }
+    }
+    size_used += banks[0].data_size;
+    printf("%u bytes available for banks (%+i bytes compared to the default %u byte budget), %u used, %u left\n",
+        size_free, (int)size_free - DEFAULT_PSX_BUDGET, DEFAULT_PSX_BUDGET, size_used, size_free - size_used);
+}
+
+// Pads the file with zeroes up to `position`
+static void write_padding(FILE* file, long position) {
+    while (ftell(file) < position) {
+        fputc(0, file);
+    }
+}
+
+// Writes one .sbk file containing the bank's regions, and the headers and data of the samples it owns.
+// If `align_sectors` is set, the sample data starts on a CD sector, every table starts on a DMA block, and
+// an upload chunk table tells the loader which sectors to stream to which SPU address. If `absolute` is set,
+// the bank was placed with an SPU memory map, and the chunk table says where each extent goes.
+static void write_bank(const Bank* bank, int bank_index, const PoolSample* pool, int n_pool_samples, int align_sectors, int absolute) {
+    // The extents are stored back to back, each one starting on a sector when aligning
+    uint32_t extent_offsets[SPU_MAP_MAX_SPANS];
+    uint32_t size_sample_data = 0;
+    for (int e = 0; e < bank->n_extents; ++e) {
+        if (align_sectors) {
+            size_sample_data = align_up(size_sample_data, CD_SECTOR_SIZE);
+        }
+        extent_offsets[e] = size_sample_data;
+        size_sample_data += bank->extents[e].size;
+    }
+
+    // Collect the samples this bank owns
+    SampleHeader* sample_headers = malloc(n_pool_samples * sizeof(SampleHeader));
+    uint8_t* sample_stack = calloc(size_sample_data + 1, 1);
+    uint32_t n_samples = 0;
+    for (int i = 0; i < n_pool_samples; ++i) {
+        if (pool[i].bank != bank_index)
+            continue;
+
+        if (pool[i].index >= 0) {
+            sample_headers[n_samples++] = pool[i].header;
+        }
+        if (pool[i].parent < 0) {
+            int e = 0;
+            while (e < bank->n_extents - 1 && pool[i].header.sample_start >= bank->extents[e].spu_start + bank->extents[e].size) {
+                e++;
+            }
+            memcpy(sample_stack + extent_offsets[e] + (pool[i].header.sample_start - bank->extents[e].spu_start), pool[i].data, pool[i].data_size);
+        }
     }
 
     // Reorder the regions in a more sane way
-    struct {
-        uint16_t region_start_index;
-        uint16_t n_regions;
-    } inst_descs[256];
+    InstDesc inst_descs[256];
 
     InstRegion regions[1024];
 
     int better_index = 0;
     for (int i = 0; i < 256; ++i) {
         inst_descs[i].region_start_index = better_index;
-        for (int j = 0; j < region_count_per_instrument[i]; ++j) {
-            regions[better_index] = inst_regions[region_indices_per_instrument[i][j]];
+        for (int j = 0; j < bank->n_entries; ++j) {
+            const BankEntry* instrument_info = &bank->entries[j];
+            if ((int)instrument_info->instrument_id != i || instrument_info->merged)
+                continue;
+
+            // Samples owned by another bank can only live in the base bank
+            const PoolSample* sample = &pool[instrument_info->sample];
+            uint16_t sample_index = sample->index;
+            if (sample->bank != bank_index) {
+                sample_index |= SAMPLE_INDEX_EXTERNAL;
+            }
+
+            regions[better_index] = (InstRegion){
+                .sample_index = sample_index,
+                .key_min      = instrument_info->key_min,
+                .key_max      = instrument_info->key_max,
+                .delay        = instrument_info->delay,
+                .attack       = instrument_info->attack,
+                .hold         = instrument_info->hold,
+                .decay        = instrument_info->decay,
+                .sustain      = instrument_info->sustain,
+                .release      = instrument_info->release,
+                .volume       = instrument_info->volume,
+                .panning      = instrument_info->panning,
+            };
             better_index++;
         }
         inst_descs[i].n_regions = better_index - inst_descs[i].region_start_index;
     }
+    uint32_t n_regions = better_index;
 
-    // Determine where and how big each section will be
-    const uint32_t size_header = 20;
+    // Determine where and how big each section will be. Offsets are relative to the end of the header
+    const uint32_t size_header = 28;
+    const uint32_t table_alignment = align_sectors ? DMA_BLOCK_SIZE : 1;
     uint32_t size_inst_descs = 256 * sizeof(uint16_t) * 2;
-    uint32_t size_region_table = n_samples * sizeof(InstRegion);
+    uint32_t size_region_table = n_regions * sizeof(InstRegion);
     uint32_t size_sample_headers = n_samples * sizeof(SampleHeader);
-    uint32_t size_sample_data = sample_stack_cursor - sample_stack;
-    uint32_t offset_inst_descs = 0;
-    uint32_t offset_region_table = offset_inst_descs + size_inst_descs;
-    uint32_t offset_sample_headers = offset_region_table + size_region_table;
+    uint32_t offset_inst_descs = align_up(size_header, table_alignment) - size_header;
+    uint32_t offset_region_table = align_up(size_header + offset_inst_descs + size_inst_descs, table_alignment) - size_header;
+    uint32_t offset_sample_headers = align_up(size_header + offset_region_table + size_region_table, table_alignment) - size_header;
     uint32_t offset_sample_data = offset_sample_headers + size_sample_headers;
 
+    // Split the sample data into chunks that can be streamed straight to SPU RAM
+    const int write_chunks = align_sectors || absolute;
+    UploadChunkTable chunk_table = { .magic = { 'C', 'H', 'N', 'K' }, .n_chunks = 0, .flags = absolute ? UPLOAD_CHUNKS_ABSOLUTE : 0 };
+    UploadChunk* chunks = NULL;
+    uint32_t offset_chunk_table = align_up(size_header + offset_sample_headers + size_sample_headers, DMA_BLOCK_SIZE) - size_header;
+    if (write_chunks) {
+        for (int e = 0; e < bank->n_extents; ++e) {
+            chunk_table.n_chunks += (bank->extents[e].size + MAX_UPLOAD_CHUNK_SIZE - 1) / MAX_UPLOAD_CHUNK_SIZE;
+        }
+        uint32_t size_chunk_table = sizeof(UploadChunkTable) + chunk_table.n_chunks * sizeof(UploadChunk);
+        offset_sample_data = align_up(size_header + offset_chunk_table + size_chunk_table, align_sectors ? CD_SECTOR_SIZE : 1) - size_header;
+
+        chunks = malloc(chunk_table.n_chunks * sizeof(UploadChunk));
+        uint32_t n_chunks = 0;
+        for (int e = 0; e < bank->n_extents; ++e) {
+            for (uint32_t start = 0; start < bank->extents[e].size; start += MAX_UPLOAD_CHUNK_SIZE) {
+                uint32_t end = (start + MAX_UPLOAD_CHUNK_SIZE < bank->extents[e].size) ? (start + MAX_UPLOAD_CHUNK_SIZE) : bank->extents[e].size;
+                chunks[n_chunks++] = (UploadChunk){
+                    .file_offset = size_header + offset_sample_data + extent_offsets[e] + start,
+                    .spu_offset  = bank->extents[e].spu_start + start,
+                    .size        = align_up(end - start, DMA_BLOCK_SIZE),
+                };
+            }
+        }
+    }
+
     // Write the output file
-    FILE* out_file = fopen(out_path, "wb");
+    FILE* out_file = fopen(bank->out_path, "wb");
     fwrite("FSBK", 1, 4, out_file);
     fwrite(&n_samples, 1, 4, out_file);
     fwrite(&offset_inst_descs, 1, 4, out_file);
@@ -249,10 +938,347 @@ int main(int argc, char** argv) {
     fwrite(&offset_sample_headers, 1, 4, out_file);
     fwrite(&offset_sample_data, 1, 4, out_file);
     fwrite(&size_sample_data, 1, 4, out_file);
+    write_padding(out_file, size_header + offset_inst_descs);
     fwrite(inst_descs, sizeof(inst_descs[0]), 256, out_file);
-    fwrite(regions, sizeof(regions[0]), n_samples, out_file);
+    write_padding(out_file, size_header + offset_region_table);
+    fwrite(regions, sizeof(regions[0]), n_regions, out_file);
+    write_padding(out_file, size_header + offset_sample_headers);
     fwrite(sample_headers, sizeof(sample_headers[0]), n_samples, out_file);
-    fwrite(sample_stack, 1, sample_stack_cursor - sample_stack, out_file);
+    if (write_chunks) {
+        write_padding(out_file, size_header + offset_chunk_table);
+        fwrite(&chunk_table, sizeof(chunk_table), 1, out_file);
+        fwrite(chunks, sizeof(chunks[0]), chunk_table.n_chunks, out_file);
+        write_padding(out_file, size_header + offset_sample_data);
+    }
+    fwrite(sample_stack, 1, size_sample_data, out_file);
+    if (align_sectors) {
+        // Pad to a whole sector, so the last chunk can be read and transferred as-is
+        write_padding(out_file, align_up(ftell(out_file), CD_SECTOR_SIZE));
+    }
+    fclose(out_file);
+
+    free(chunks);
+    free(sample_headers);
+    free(sample_stack);
+}
+
+int main(int argc, char** argv) {
+    // Validate input
+    if (argc < 4) {
+        printf("Usage: psx_soundfont_creator.exe <.csv> <.sbk> <format> [options]\n");
+        printf("Formats:\n");
+        printf("    psx                     SPU-ADPCM, for the PS1's SPU RAM\n");
+        printf("    pcm16                   Uncompressed 16-bit samples, for the PC port\n");
+        printf("    spu-adpcm               SPU-ADPCM, for the PC port (decoded in software, no SPU RAM limit)\n");
+        printf("    ima-adpcm               4-bit IMA-ADPCM in independent 64-byte blocks, for the PC port\n");
+        printf("Options:\n");
+        printf("    --merge <dB>            Merge adjacent regions whose samples differ by at most <dB> spectrally\n");
+        printf("    --merge-report <dB>     Only report which regions --merge would merge\n");
+        printf("    --dither                Add TPDF dither when converting 24-bit, 32-bit, float or downmixed samples to 16-bit\n");
+        printf("    --align-sectors         Align the sample data to CD sectors and add an upload chunk table, so the\n");
+        printf("                            loader can stream sectors straight to SPU RAM\n");
+        printf("    --patch-from <old .sbk> <.patch>\n");
+        printf("                            Also write a patch that turns a previous build of the bank into this one.\n");
+        printf("                            Samples that didn't change keep their place from the previous build\n");
+        printf("    --dependent <.csv> <.sbk>\n");
+        printf("                            Build another bank that is loaded alongside this one. Samples used by\n");
+        printf("                            more than one bank are only stored once, in this (base) bank\n");
+        printf("    --spu-map <file>        Place the sample data around the reverb work area and reserved regions\n");
+        printf("                            listed in <file>, at absolute SPU addresses, instead of in a fixed %i KB\n", DEFAULT_PSX_BUDGET / 1024);
+        printf("    --compact               Write the banks in the compact v2 format (psx only)\n");
+        exit(1);
+    }
+    const char* format_str = argv[3];
+
+    // The first bank is the base bank, all others are loaded on top of it
+    Bank banks[MAX_BANKS] = { 0 };
+    int n_banks = 1;
+    banks[0].def_path = argv[1];
+    banks[0].out_path = argv[2];
+
+    // Parse options
+    float merge_tolerance = -1.0f;
+    int merge_apply = 0;
+    int align_sectors = 0;
+    int dither = 0;
+    const char* patch_base_path = NULL;
+    const char* patch_path = NULL;
+    const char* spu_map_path = NULL;
+    int compact = 0;
+    for (int arg = 4; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "--merge") == 0 && arg + 1 < argc) {
+            merge_tolerance = (float)atof(argv[++arg]);
+            merge_apply = 1;
+        }
+        else if (strcmp(argv[arg], "--merge-report") == 0 && arg + 1 < argc) {
+            merge_tolerance = (float)atof(argv[++arg]);
+            merge_apply = 0;
+        }
+        else if (strcmp(argv[arg], "--dither") == 0) {
+            dither = 1;
+        }
+        else if (strcmp(argv[arg], "--align-sectors") == 0) {
+            align_sectors = 1;
+        }
+        else if (strcmp(argv[arg], "--patch-from") == 0 && arg + 2 < argc) {
+            patch_base_path = argv[++arg];
+            patch_path = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--dependent") == 0 && arg + 2 < argc && n_banks < MAX_BANKS) {
+            banks[n_banks].def_path = argv[++arg];
+            banks[n_banks].out_path = argv[++arg];
+            n_banks++;
+        }
+        else if (strcmp(argv[arg], "--spu-map") == 0 && arg + 1 < argc) {
+            spu_map_path = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--compact") == 0) {
+            compact = 1;
+        }
+        else {
+            printf("Unknown option '%s'\n", argv[arg]);
+            exit(1);
+        }
+    }
+
+    // Parse format
+    size_t available_space = 0;
+    Format format;
+    int spu_ram_target = 0;
+    if (strcmp(format_str, "psx") == 0) {
+        // The PS1 has 512 KB of sound RAM, without a memory map I allocate 380 KB for music instruments
+        format = FORMAT_PSX;
+        available_space = DEFAULT_PSX_BUDGET;
+        spu_ram_target = 1;
+    }
+    else if (strcmp(format_str, "pcm16") == 0) {
+        format = FORMAT_PCM16;
+        available_space = 256 * 1024 * 1024;
+    }
+    else if (strcmp(format_str, "spu-adpcm") == 0) {
+        // Same data as psx, but the PC port decodes it in software, so it isn't limited by SPU RAM
+        format = FORMAT_PSX;
+        available_space = 256 * 1024 * 1024;
+    }
+    else if (strcmp(format_str, "ima-adpcm") == 0) {
+        format = FORMAT_IMA_ADPCM;
+        available_space = 256 * 1024 * 1024;
+    }
+    else {
+        printf("Unknown format '%s'\n", format_str);
+        return 1;
+    }
+
+    if (patch_path != NULL && n_banks > 1) {
+        printf("--patch-from can't be combined with --dependent\n");
+        return 1;
+    }
+    if (compact && (format != FORMAT_PSX || patch_path != NULL)) {
+        printf("--compact only applies to the psx format, and can't be combined with --patch-from\n");
+        return 1;
+    }
+
+    // Find out which parts of SPU RAM the banks can use
+    SpuMap spu_map;
+    SpuRegion spu_free_spans[SPU_MAP_MAX_SPANS];
+    int n_spu_free_spans = 0;
+    if (spu_map_path != NULL) {
+        if (!spu_ram_target) {
+            printf("--spu-map only applies to the psx format\n");
+            return 1;
+        }
+        if (!load_spu_map(spu_map_path, &spu_map)) {
+            return 1;
+        }
+        n_spu_free_spans = get_spu_free_spans(&spu_map, spu_free_spans, SPU_MAP_MAX_SPANS);
+    }
+
+    // Load all the soundbank definitions
+    for (int b = 0; b < n_banks; ++b) {
+        banks[b].entries = calloc(1024, sizeof(BankEntry));
+        banks[b].n_entries = load_bank_definition(banks[b].def_path, banks[b].entries, dither);
+        if (banks[b].n_entries < 0) {
+            return 1;
+        }
+
+        // Drop multisamples that are close enough to their neighbours
+        if (merge_tolerance >= 0.0f) {
+            merge_similar_regions(banks[b].entries, banks[b].n_entries, format, merge_tolerance, merge_apply);
+        }
+    }
+
+    // Gather all the samples that are still used into one pool, storing each unique sample only once
+    PoolSample* pool = calloc(1024 * MAX_BANKS, sizeof(PoolSample));
+    int n_pool_samples = 0;
+    for (int b = 0; b < n_banks; ++b) {
+        for (int i = 0; i < banks[b].n_entries; ++i) {
+            BankEntry* instrument_info = &banks[b].entries[i];
+            if (instrument_info->merged)
+                continue;
+
+            int sample = 0;
+            while (sample < n_pool_samples && (pool[sample].is_slice_source || !same_wave(&pool[sample].wave, &instrument_info->wave))) {
+                sample++;
+            }
+
+            if (sample == n_pool_samples) {
+                // Slices go into one piece of data per sample source
+                int parent = -1;
+                if (instrument_info->source.samples != NULL) {
+                    parent = 0;
+                    while (parent < n_pool_samples && (!pool[parent].is_slice_source || !same_wave(&pool[parent].wave, &instrument_info->source))) {
+                        parent++;
+                    }
+                    if (parent == n_pool_samples) {
+                        pool[parent] = (PoolSample){ .name = instrument_info->sample_source, .wave = instrument_info->source, .bank = b, .is_slice_source = 1, .parent = -1 };
+                        n_pool_samples++;
+                    }
+                    sample = n_pool_samples;
+                }
+                pool[sample].name = instrument_info->sample_source;
+                pool[sample].wave = instrument_info->wave;
+                pool[sample].bank = b;
+                pool[sample].parent = parent;
+                pool[sample].slice_start = instrument_info->slice_start;
+                n_pool_samples++;
+            }
+            else if (pool[sample].bank != b) {
+                pool[sample].bank = 0;
+            }
+            instrument_info->sample = sample;
+        }
+    }
+
+    // A slice's header lives in the same bank as the data it points into
+    for (int i = 0; i < n_pool_samples; ++i) {
+        if (pool[i].parent >= 0 && pool[i].bank != pool[pool[i].parent].bank) {
+            pool[pool[i].parent].bank = 0;
+        }
+    }
+    for (int i = 0; i < n_pool_samples; ++i) {
+        if (pool[i].parent >= 0) {
+            pool[i].bank = pool[pool[i].parent].bank;
+        }
+    }
+
+    // Keep the previous build around, the new one will overwrite it if they share a path. Its layout is kept as much
+    // as possible, so the patch stays small
+    uint8_t* patch_base = NULL;
+    uint32_t patch_base_size = 0;
+    if (patch_path != NULL) {
+        patch_base = read_file(patch_base_path, &patch_base_size);
+    }
+
+    // Convert the samples, and lay out every bank's sample data
+    for (int i = 0; i < n_pool_samples; ++i) {
+        if (pool[i].is_slice_source) {
+            encode_slices(pool, n_pool_samples, i, format);
+        }
+        else if (pool[i].parent < 0) {
+            encode_sample(&pool[i], format);
+        }
+    }
+    for (int b = 0; b < n_banks; ++b) {
+        // The base bank's last upload chunk is rounded up to a whole DMA block, keep it clear of this bank's data
+        banks[b].data_offset = (b == 0) ? 0 : align_up(banks[0].data_size, align_sectors ? DMA_BLOCK_SIZE : 16);
+        uint32_t n_samples = 0;
+        for (int i = 0; i < n_pool_samples; ++i) {
+            if (pool[i].bank != b)
+                continue;
+            pool[i].index = pool[i].is_slice_source ? -1 : (int)n_samples++;
+            if (pool[i].parent >= 0)
+                continue;
+            banks[b].data_size = (banks[b].data_size + 15) & ~15;
+            pool[i].header.sample_start = banks[b].data_offset + banks[b].data_size;
+            banks[b].data_size += pool[i].data_size;
+        }
+        banks[b].extents[0] = (DataExtent){ .spu_start = banks[b].data_offset, .size = banks[b].data_size };
+        banks[b].n_extents = 1;
+    }
+    size_t size_left_over = 0;
+    if (spu_map_path != NULL) {
+        if (patch_base != NULL) {
+            size_left_over = place_samples_stable(&banks[0], pool, n_pool_samples, patch_base, patch_base_size, spu_free_spans, n_spu_free_spans, 1);
+        }
+        else {
+            size_left_over = place_samples(banks, n_banks, pool, n_pool_samples, spu_free_spans, n_spu_free_spans);
+        }
+        print_spu_map(&spu_map, spu_free_spans, n_spu_free_spans, banks, n_banks);
+    }
+    else if (patch_base != NULL) {
+        SpuRegion whole = { .start = 0, .end = (uint32_t)available_space, .name = "free" };
+        size_left_over = place_samples_stable(&banks[0], pool, n_pool_samples, patch_base, patch_base_size, &whole, 1, 0);
+    }
+    for (int i = 0; i < n_pool_samples; ++i) {
+        if (pool[i].parent >= 0) {
+            pool[i].header.sample_start = pool[pool[i].parent].header.sample_start + pool[i].parent_offset;
+        }
+    }
+
+    // Notify the user if we run out of RAM, might be nice for them to know.
+    int out_of_memory = 0;
+    if (size_left_over > 0) {
+        printf("Out of Sound RAM! Try downsampling or cutting the samples shorter, or a smaller reverb mode\n");
+        printf("Samples that don't fit around the reserved regions: %zu bytes\n", size_left_over);
+        out_of_memory = 1;
+    }
+    for (int b = 0; b < n_banks && spu_map_path == NULL; ++b) {
+        int size_left = (int)available_space - (int)(banks[b].data_offset + banks[b].data_size);
+        if (size_left < 0) {
+            printf("Out of Sound RAM! Try downsampling or cutting the samples shorter\n");
+            printf("Amount of bytes to reduce: %i\n", -size_left);
+            if (n_banks > 1) {
+                printf("(while loading '%s' on top of '%s')\n", banks[b].def_path, banks[0].def_path);
+            }
+            out_of_memory = 1;
+        }
+    }
+    if (out_of_memory) {
+        return 1;
+    }
+
+    // Write the output files
+    for (int b = 0; b < n_banks; ++b) {
+        write_bank(&banks[b], b, pool, n_pool_samples, align_sectors, spu_map_path != NULL);
+        if (compact && !compact_bank_file(banks[b].out_path)) {
+            return 1;
+        }
+    }
+
+    // Diff the base bank against its previous build
+    if (patch_base != NULL) {
+        if (!create_patch(patch_base, patch_base_size, banks[0].out_path, patch_path)) {
+            return 1;
+        }
+        free(patch_base);
+    }
+
+    // Show how the banks share SPU RAM
+    if (n_banks > 1) {
+        size_t size_separate = 0;
+        size_t size_shared = 0;
+        for (int i = 0; i < n_pool_samples; ++i) {
+            int n_users = 0;
+            for (int b = 0; b < n_banks; ++b) {
+                for (int j = 0; j < banks[b].n_entries; ++j) {
+                    if (!banks[b].entries[j].merged && banks[b].entries[j].sample == i) {
+                        n_users++;
+                        break;
+                    }
+                }
+            }
+            size_separate += ((pool[i].data_size + 15) & ~15) * n_users;
+            if (pool[i].parent < 0) {
+                size_shared += (pool[i].data_size + 15) & ~15;
+            }
+        }
+        for (int b = 0; b < n_banks; ++b) {
+            if (spu_map_path == NULL) {
+                printf("%s: %u bytes of sample data at SPU offset %u\n", banks[b].out_path, banks[b].data_size, banks[b].data_offset);
+            }
+        }
+        printf("Shared sample pool saves %zu bytes over building the banks separately\n", size_separate - size_shared);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
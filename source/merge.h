@@ -0,0 +1,162 @@
+#ifndef MERGE
+#define MERGE
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "wav.h"
+
+#define SPECTRUM_FFT_SIZE 2048
+#define SPECTRUM_MAX_FRAMES 32
+#define SPECTRUM_FLOOR_DB -60.0f
+#define SPECTRUM_MIN_BAND_HZ 50.0f
+
+typedef struct {
+    float power[SPECTRUM_FFT_SIZE / 2 + 1]; // Average power per FFT bin
+    uint32_t sample_rate;                   // Sample rate (Hz) the bins are relative to, i.e. the rate at MIDI key 60
+} Spectrum;
+
+// In-place iterative radix-2 FFT, n must be a power of two
+void fft(float* re, float* im, int n) {
+    // Bit reversal permutation
+    for (int i = 1, j = 0; i < n; ++i) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    // Butterflies
+    for (int len = 2; len <= n; len <<= 1) {
+        float angle = -2.0f * (float)M_PI / (float)len;
+        float w_re = cosf(angle);
+        float w_im = sinf(angle);
+        for (int i = 0; i < n; i += len) {
+            float c_re = 1.0f;
+            float c_im = 0.0f;
+            for (int j = 0; j < len / 2; ++j) {
+                float* a_re = &re[i + j];
+                float* a_im = &im[i + j];
+                float* b_re = &re[i + j + len / 2];
+                float* b_im = &im[i + j + len / 2];
+                float t_re = *b_re * c_re - *b_im * c_im;
+                float t_im = *b_re * c_im + *b_im * c_re;
+                *b_re = *a_re - t_re;
+                *b_im = *a_im - t_im;
+                *a_re += t_re;
+                *a_im += t_im;
+                float next_re = c_re * w_re - c_im * w_im;
+                c_im = c_re * w_im + c_im * w_re;
+                c_re = next_re;
+            }
+        }
+    }
+}
+
+// Averages the power spectrum of up to SPECTRUM_MAX_FRAMES Hann-windowed frames (Welch's method)
+void compute_spectrum(const WaveFile* wave, Spectrum* spectrum) {
+    static float re[SPECTRUM_FFT_SIZE];
+    static float im[SPECTRUM_FFT_SIZE];
+    const int n = SPECTRUM_FFT_SIZE;
+    const int hop = SPECTRUM_FFT_SIZE / 2;
+
+    memset(spectrum->power, 0, sizeof(spectrum->power));
+    spectrum->sample_rate = wave->sample_rate;
+
+    int n_frames = 0;
+    for (int start = 0; n_frames < SPECTRUM_MAX_FRAMES; start += hop) {
+        // Always analyze at least one (zero-padded) frame, even for very short samples
+        if (start > 0 && start + n > wave->length) {
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            float window = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * (float)i / (float)(n - 1));
+            re[i] = (start + i < wave->length) ? (float)wave->samples[start + i] * window : 0.0f;
+            im[i] = 0.0f;
+        }
+        fft(re, im, n);
+        for (int i = 0; i <= n / 2; ++i) {
+            spectrum->power[i] += re[i] * re[i] + im[i] * im[i];
+        }
+        n_frames++;
+    }
+
+    for (int i = 0; i <= n / 2; ++i) {
+        spectrum->power[i] /= (float)n_frames;
+    }
+}
+
+// Sums the power in [low, high) Hz, falling back to the nearest bin when the band is narrower than a bin
+static float spectrum_band_power(const Spectrum* spectrum, float low, float high) {
+    float bin_width = (float)spectrum->sample_rate / (float)SPECTRUM_FFT_SIZE;
+    int first = (int)ceilf(low / bin_width);
+    int last = (int)ceilf(high / bin_width) - 1;
+    if (last > SPECTRUM_FFT_SIZE / 2) last = SPECTRUM_FFT_SIZE / 2;
+    if (last < first) {
+        int nearest = (int)((low + high) * 0.5f / bin_width + 0.5f);
+        if (nearest > SPECTRUM_FFT_SIZE / 2) nearest = SPECTRUM_FFT_SIZE / 2;
+        return spectrum->power[nearest];
+    }
+
+    float power = 0.0f;
+    for (int i = first; i <= last; ++i) {
+        power += spectrum->power[i];
+    }
+    return power;
+}
+
+// Returns the RMS difference (dB) between the loudness-normalized third-octave band spectra of two samples.
+// Bins are compared in Hz at each sample's own rate, which is how both are pitched relative to MIDI key 60,
+// so a sample stretched over its neighbour's keys is shifted by exactly the same ratio as the neighbour.
+float spectral_distance(const Spectrum* a, const Spectrum* b) {
+    float bands_a[64];
+    float bands_b[64];
+    float total_a = 0.0f;
+    float total_b = 0.0f;
+    int n_bands = 0;
+
+    // Only compare what both samples can reproduce
+    uint32_t min_rate = (a->sample_rate < b->sample_rate) ? a->sample_rate : b->sample_rate;
+    float limit = 0.45f * (float)min_rate;
+    const float band_ratio = 1.25992105f; // 2^(1/3)
+    for (float low = SPECTRUM_MIN_BAND_HZ; low * band_ratio <= limit && n_bands < 64; low *= band_ratio) {
+        bands_a[n_bands] = spectrum_band_power(a, low, low * band_ratio);
+        bands_b[n_bands] = spectrum_band_power(b, low, low * band_ratio);
+        total_a += bands_a[n_bands];
+        total_b += bands_b[n_bands];
+        n_bands++;
+    }
+
+    // Silence on either side is as different as it gets
+    if (total_a <= 0.0f || total_b <= 0.0f) {
+        return (total_a == total_b) ? 0.0f : -SPECTRUM_FLOOR_DB;
+    }
+
+    float sum_squares = 0.0f;
+    int n_compared = 0;
+    for (int i = 0; i < n_bands; ++i) {
+        float db_a = 10.0f * log10f(bands_a[i] / total_a + 1e-12f);
+        float db_b = 10.0f * log10f(bands_b[i] / total_b + 1e-12f);
+        if (db_a < SPECTRUM_FLOOR_DB) db_a = SPECTRUM_FLOOR_DB;
+        if (db_b < SPECTRUM_FLOOR_DB) db_b = SPECTRUM_FLOOR_DB;
+
+        // Bands that are inaudible in both samples don't say anything about similarity
+        if (db_a == SPECTRUM_FLOOR_DB && db_b == SPECTRUM_FLOOR_DB) {
+            continue;
+        }
+        sum_squares += (db_a - db_b) * (db_a - db_b);
+        n_compared++;
+    }
+
+    if (n_compared == 0) {
+        return 0.0f;
+    }
+    return sqrtf(sum_squares / (float)n_compared);
+}
+#endif
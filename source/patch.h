@@ -0,0 +1,276 @@
+#ifndef PATCH
+#define PATCH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "soundbank.h"
+
+// A patch turns one build of a .sbk into the next. Every section of the bank is diffed separately, in units of
+// whole table entries or 16-byte ADPCM blocks, so a loader can apply the records directly to the tables it keeps
+// in RAM, and upload the SAMPLE_DATA records straight to SPU RAM at the bank's base address + offset.
+typedef enum {
+    PATCH_SECTION_HEADER,           // BankHeader
+    PATCH_SECTION_INST_DESCS,       // Instrument descriptors
+    PATCH_SECTION_REGIONS,          // Region table
+    PATCH_SECTION_SAMPLE_HEADERS,   // Sample headers, followed by the upload chunk table if there is one
+    PATCH_SECTION_SAMPLE_DATA,      // Sample data chunk
+    PATCH_SECTION_COUNT,
+} PatchSection;
+
+typedef struct {
+    char magic[4];          // "FSBP"
+    uint32_t base_size;     // Size (bytes) of the .sbk this patch applies to
+    uint32_t base_hash;     // FNV-1a hash of the .sbk this patch applies to
+    uint32_t result_size;   // Size (bytes) of the .sbk after patching
+    uint32_t result_hash;   // FNV-1a hash of the .sbk after patching
+    uint32_t n_records;     // Number of PatchRecords that follow
+} PatchHeader;
+
+typedef struct {
+    uint32_t section;       // PatchSection
+    uint32_t offset;        // Offset (bytes) into the section
+    uint32_t length;        // Number of bytes of new data that directly follow this record
+} PatchRecord;
+
+typedef struct {
+    uint32_t start;         // Offset (bytes) from the start of the file
+    uint32_t size;
+} BankSpan;
+
+// Sections are compared in units of this many bytes
+static const uint32_t patch_section_granularity[PATCH_SECTION_COUNT] = {
+    sizeof(uint32_t),
+    sizeof(uint16_t) * 2,
+    sizeof(InstRegion),
+    sizeof(SampleHeader),
+    16,
+};
+
+uint32_t fnv1a_hash(const uint8_t* data, uint32_t size) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Splits a .sbk file into its sections. Returns 0 if it isn't a valid bank
+int get_bank_spans(const uint8_t* file, uint32_t size, BankSpan spans[PATCH_SECTION_COUNT]) {
+    BankHeader header;
+    if (size < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, file, sizeof(header));
+    if (memcmp(header.magic, "FSBK", 4) != 0) {
+        return 0;
+    }
+
+    // Padding after a table belongs to that table's section. The header is always patched on its own, so the padding
+    // after it goes to the instrument descriptors instead
+    uint32_t starts[PATCH_SECTION_COUNT + 1] = {
+        0,
+        sizeof(header),
+        sizeof(header) + header.offset_region_table,
+        sizeof(header) + header.offset_sample_headers,
+        sizeof(header) + header.offset_sample_data,
+        size,
+    };
+    for (int i = 0; i < PATCH_SECTION_COUNT; ++i) {
+        if (starts[i + 1] < starts[i] || starts[i + 1] > size) {
+            return 0;
+        }
+        spans[i].start = starts[i];
+        spans[i].size = starts[i + 1] - starts[i];
+    }
+    return 1;
+}
+
+static void patch_append(uint8_t** buffer, uint32_t* size, uint32_t* capacity, const void* data, uint32_t length) {
+    while (*size + length > *capacity) {
+        *capacity = (*capacity == 0) ? 4096 : (*capacity * 2);
+        *buffer = realloc(*buffer, *capacity);
+    }
+    memcpy(*buffer + *size, data, length);
+    *size += length;
+}
+
+static void patch_add_record(uint8_t** buffer, uint32_t* size, uint32_t* capacity, PatchHeader* header, uint32_t section, uint32_t start, uint32_t end, const uint8_t* new_data) {
+    PatchRecord record = { .section = section, .offset = start, .length = end - start };
+    patch_append(buffer, size, capacity, &record, sizeof(record));
+    patch_append(buffer, size, capacity, new_data + start, record.length);
+    header->n_records++;
+}
+
+// Diffs the previous build of a bank against the one at `new_path` and writes the patch to `patch_path`. Returns 0 on failure
+int create_patch(const uint8_t* old_file, uint32_t old_size, const char* new_path, const char* patch_path) {
+    uint32_t new_size = 0;
+    uint8_t* new_file = read_file(new_path, &new_size);
+    BankSpan old_spans[PATCH_SECTION_COUNT];
+    BankSpan new_spans[PATCH_SECTION_COUNT];
+    if (new_file == NULL || !get_bank_spans(old_file, old_size, old_spans) || !get_bank_spans(new_file, new_size, new_spans)) {
+        printf("Can't create a patch for '%s', the previous build is not a valid soundbank\n", new_path);
+        free(new_file);
+        return 0;
+    }
+
+    uint8_t* records = NULL;
+    uint32_t records_size = 0;
+    uint32_t records_capacity = 0;
+    PatchHeader header = {
+        .magic = { 'F', 'S', 'B', 'P' },
+        .base_size = old_size,
+        .base_hash = fnv1a_hash(old_file, old_size),
+        .result_size = new_size,
+        .result_hash = fnv1a_hash(new_file, new_size),
+        .n_records = 0,
+    };
+
+    uint32_t changed_bytes[PATCH_SECTION_COUNT] = { 0 };
+    for (int section = 0; section < PATCH_SECTION_COUNT; ++section) {
+        const uint8_t* old_data = old_file + old_spans[section].start;
+        const uint8_t* new_data = new_file + new_spans[section].start;
+        uint32_t old_section_size = old_spans[section].size;
+        uint32_t new_section_size = new_spans[section].size;
+        uint32_t granularity = patch_section_granularity[section];
+
+        // Find runs of changed units. Runs that are closer together than a record header are joined
+        uint32_t run_start = 0;
+        uint32_t run_end = 0;
+        int in_run = 0;
+        for (uint32_t offset = 0; offset < new_section_size; offset += granularity) {
+            uint32_t length = (offset + granularity < new_section_size) ? granularity : (new_section_size - offset);
+            int changed = (offset + length > old_section_size) || memcmp(old_data + offset, new_data + offset, length) != 0;
+            if (!changed)
+                continue;
+
+            if (in_run && offset - run_end > sizeof(PatchRecord)) {
+                patch_add_record(&records, &records_size, &records_capacity, &header, section, run_start, run_end, new_data);
+                changed_bytes[section] += run_end - run_start;
+                in_run = 0;
+            }
+            if (!in_run) {
+                run_start = offset;
+                in_run = 1;
+            }
+            run_end = offset + length;
+        }
+        if (in_run) {
+            patch_add_record(&records, &records_size, &records_capacity, &header, section, run_start, run_end, new_data);
+            changed_bytes[section] += run_end - run_start;
+        }
+    }
+
+    FILE* patch_file = fopen(patch_path, "wb");
+    if (patch_file == NULL) {
+        printf("Failed to open file '%s'\n", patch_path);
+        free(new_file);
+        free(records);
+        return 0;
+    }
+    fwrite(&header, sizeof(header), 1, patch_file);
+    fwrite(records, 1, records_size, patch_file);
+    fclose(patch_file);
+
+    printf("Patch '%s': %u records, %u bytes (bank is %u bytes)\n", patch_path, header.n_records, (uint32_t)(sizeof(header) + records_size), new_size);
+    printf("    %u bytes of tables, %u bytes of SPU data changed\n",
+        changed_bytes[PATCH_SECTION_HEADER] + changed_bytes[PATCH_SECTION_INST_DESCS] + changed_bytes[PATCH_SECTION_REGIONS] + changed_bytes[PATCH_SECTION_SAMPLE_HEADERS],
+        changed_bytes[PATCH_SECTION_SAMPLE_DATA]);
+
+    free(new_file);
+    free(records);
+    return 1;
+}
+
+// Applies a patch to a bank. Returns the patched bank, or NULL if the patch doesn't belong to this bank
+uint8_t* apply_patch(const uint8_t* old_file, uint32_t old_size, const uint8_t* patch, uint32_t patch_size, uint32_t* new_size) {
+    PatchHeader header;
+    BankSpan old_spans[PATCH_SECTION_COUNT];
+    BankSpan new_spans[PATCH_SECTION_COUNT];
+    if (patch_size < sizeof(header)) {
+        printf("Invalid patch file\n");
+        return NULL;
+    }
+    memcpy(&header, patch, sizeof(header));
+    if (memcmp(header.magic, "FSBP", 4) != 0) {
+        printf("Invalid patch file\n");
+        return NULL;
+    }
+    if (header.base_size != old_size || header.base_hash != fnv1a_hash(old_file, old_size) || !get_bank_spans(old_file, old_size, old_spans)) {
+        printf("This patch does not apply to this soundbank\n");
+        return NULL;
+    }
+
+    if (header.result_size < sizeof(BankHeader)) {
+        printf("Invalid patch file\n");
+        return NULL;
+    }
+
+    // The header has to be patched first, it determines where all the other sections end up
+    uint8_t* new_file = calloc(header.result_size, 1);
+    if (new_file == NULL) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+    memcpy(new_file, old_file, sizeof(BankHeader));
+    const uint8_t* cursor = patch + sizeof(header);
+    for (int pass = 0; pass < 2; ++pass) {
+        cursor = patch + sizeof(header);
+        for (uint32_t i = 0; i < header.n_records; ++i) {
+            PatchRecord record;
+            if (cursor + sizeof(record) > patch + patch_size) {
+                printf("Invalid patch file\n");
+                free(new_file);
+                return NULL;
+            }
+            memcpy(&record, cursor, sizeof(record));
+            cursor += sizeof(record);
+            if (record.length > (uint32_t)(patch + patch_size - cursor) || record.section >= PATCH_SECTION_COUNT) {
+                printf("Invalid patch file\n");
+                free(new_file);
+                return NULL;
+            }
+
+            if (pass == 0 && record.section == PATCH_SECTION_HEADER) {
+                if (record.offset > sizeof(BankHeader) || record.length > sizeof(BankHeader) - record.offset) {
+                    printf("Invalid patch file\n");
+                    free(new_file);
+                    return NULL;
+                }
+                memcpy(new_file + record.offset, cursor, record.length);
+            }
+            else if (pass == 1 && record.section != PATCH_SECTION_HEADER) {
+                if (record.offset > new_spans[record.section].size || record.length > new_spans[record.section].size - record.offset) {
+                    printf("Invalid patch file\n");
+                    free(new_file);
+                    return NULL;
+                }
+                memcpy(new_file + new_spans[record.section].start + record.offset, cursor, record.length);
+            }
+            cursor += record.length;
+        }
+
+        // Now that the header is known, move the unchanged parts of every section to their new place
+        if (pass == 0) {
+            if (!get_bank_spans(new_file, header.result_size, new_spans)) {
+                printf("Invalid patch file\n");
+                free(new_file);
+                return NULL;
+            }
+            for (int section = PATCH_SECTION_INST_DESCS; section < PATCH_SECTION_COUNT; ++section) {
+                uint32_t size = (old_spans[section].size < new_spans[section].size) ? old_spans[section].size : new_spans[section].size;
+                memcpy(new_file + new_spans[section].start, old_file + old_spans[section].start, size);
+            }
+        }
+    }
+
+    if (fnv1a_hash(new_file, header.result_size) != header.result_hash) {
+        printf("Patched soundbank does not match the expected result\n");
+        free(new_file);
+        return NULL;
+    }
+    *new_size = header.result_size;
+    return new_file;
+}
+#endif
@@ -0,0 +1,38 @@
+#include "bankv2.h"
+
+// Converts banks between the v1 ("FSBK") and compact v2 ("FSB2") formats, whichever way the input isn't
+int main(int argc, char** argv) {
+    // Validate input
+    if (argc != 3) {
+        printf("Usage: sbk_convert.exe <in .sbk> <out .sbk>\n");
+        exit(1);
+    }
+
+    uint32_t in_size = 0;
+    uint32_t out_size = 0;
+    uint8_t* in_file = read_file(argv[1], &in_size);
+    if (in_file == NULL) {
+        return 1;
+    }
+
+    uint8_t* out_file_data = NULL;
+    if (in_size >= 4 && memcmp(in_file, "FSB2", 4) == 0) {
+        out_file_data = convert_bank_to_v1(in_file, in_size, &out_size);
+    }
+    else {
+        out_file_data = convert_bank_to_v2(in_file, in_size, &out_size);
+    }
+    if (out_file_data == NULL) {
+        return 1;
+    }
+
+    FILE* out_file = fopen(argv[2], "wb");
+    if (out_file == NULL) {
+        printf("Failed to open file '%s'\n", argv[2]);
+        return 1;
+    }
+    fwrite(out_file_data, 1, out_size, out_file);
+    fclose(out_file);
+    printf("%s: %u bytes -> %s: %u bytes\n", argv[1], in_size, argv[2], out_size);
+    return 0;
+}
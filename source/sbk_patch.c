@@ -0,0 +1,33 @@
+#include "patch.h"
+
+// Reference applier for the patches written by `psx_soundfont_generator --patch-from`
+int main(int argc, char** argv) {
+    // Validate input
+    if (argc != 4) {
+        printf("Usage: sbk_patch.exe <old .sbk> <.patch> <new .sbk>\n");
+        exit(1);
+    }
+
+    uint32_t old_size = 0;
+    uint32_t patch_size = 0;
+    uint32_t new_size = 0;
+    uint8_t* old_file = read_file(argv[1], &old_size);
+    uint8_t* patch = read_file(argv[2], &patch_size);
+    if (old_file == NULL || patch == NULL) {
+        return 1;
+    }
+
+    uint8_t* new_file = apply_patch(old_file, old_size, patch, patch_size, &new_size);
+    if (new_file == NULL) {
+        return 1;
+    }
+
+    FILE* out_file = fopen(argv[3], "wb");
+    if (out_file == NULL) {
+        printf("Failed to open file '%s'\n", argv[3]);
+        return 1;
+    }
+    fwrite(new_file, 1, new_size, out_file);
+    fclose(out_file);
+    return 0;
+}
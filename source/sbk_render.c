@@ -0,0 +1,821 @@
+#include "libpsxav.h"
+#include "soundbank.h"
+#include "bankv2.h"
+#include "codec.h"
+#include <math.h>
+#include <time.h>
+
+#define OUTPUT_RATE 44100
+#define SPU_VOICE_COUNT 24
+#define MAX_VOICES 256
+#define SPU_PITCH_MAX 0x3FFF        // The SPU can't play a sample more than 4x faster than 44100 Hz
+#define REGION_VOLUME_MAX 255.0f    // Region volume that plays a sample at full volume
+#define MAX_TAIL_SECONDS 10
+#define IMA_DECODE_BLOCKS 4         // IMA-ADPCM blocks decoded ahead at once, one per SSE2 lane
+
+typedef struct {
+    uint64_t tick;
+    uint32_t order;         // Position in the file, keeps simultaneous events in order after sorting
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+    uint32_t tempo;         // Microseconds per quarter note, for tempo changes (status 0xFF)
+    double time;            // Seconds from the start of the song
+} MidiEvent;
+
+typedef struct {
+    uint8_t program;
+    uint8_t volume;
+    uint8_t expression;
+    uint8_t pan;
+    uint8_t sustain_pedal;
+    int16_t pitch_bend;     // -8192 to 8191, +-2 semitones
+} MidiChannel;
+
+typedef enum {
+    ENVELOPE_DELAY,
+    ENVELOPE_ATTACK,
+    ENVELOPE_HOLD,
+    ENVELOPE_DECAY,
+    ENVELOPE_SUSTAIN,
+    ENVELOPE_RELEASE,
+    ENVELOPE_DONE,
+} EnvelopeStage;
+
+typedef struct {
+    int active;
+    int channel;
+    int key;
+    int held_by_pedal;      // Key was released while the sustain pedal was down
+    uint64_t started;       // Voice start order, to find the oldest voice
+    const SampleHeader* sample;
+    const InstRegion* region;
+
+    // Sample playback
+    uint32_t address;       // Byte address of the current ADPCM block, or the next PCM sample
+    uint32_t loop_address;
+    uint32_t frame;         // Next frame to play, for IMA-ADPCM
+    uint32_t block_frame;   // First frame in `block`, for IMA-ADPCM
+    uint32_t block_frames;  // Number of frames in `block`, for IMA-ADPCM
+    int16_t block[IMA_DECODE_BLOCKS * IMA_ADPCM_BLOCK_SAMPLES];
+    int block_position;     // Next sample to take from `block`, 28 if a new block is needed
+    int block_flags;
+    SpuAdpcmState decoder;
+    int16_t history[4];     // Last four samples, oldest first, for the interpolator
+    uint32_t counter;       // Pitch counter, 12 fractional bits
+    float base_pitch;       // Pitch at no pitch bend, in SPU units (4096 = 44100 Hz)
+    uint32_t pitch;
+    int sample_ended;
+
+    // Envelope and mixing
+    EnvelopeStage stage;
+    uint32_t stage_position;
+    uint32_t stage_length;
+    float level;
+    float release_level;
+    float volume_left;
+    float volume_right;
+} Voice;
+
+typedef struct {
+    uint64_t note_ons;
+    uint64_t voices_started;
+    uint64_t voices_stolen;
+    uint64_t unmatched_notes;   // Note-ons for which the bank has no region
+    uint64_t bad_samples;       // Regions that point to a missing sample, or past the end of the sample data
+    uint64_t voice_samples;     // Sum of active voices over every output sample
+    int peak_voices;
+    double peak_voices_time;
+} RenderStats;
+
+// The SPU interpolates between the last four samples using this 512-entry Gaussian table, indexed by bits 4-11 of the
+// pitch counter. This is the table from the hardware; the four taps add up to slightly less than unity gain
+static const int16_t gauss_table[512] = {
+    -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001,
+    -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001, -0x0001,
+    0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0001,
+    0x0001, 0x0001, 0x0001, 0x0002, 0x0002, 0x0002, 0x0003, 0x0003,
+    0x0003, 0x0004, 0x0004, 0x0005, 0x0005, 0x0006, 0x0007, 0x0007,
+    0x0008, 0x0009, 0x0009, 0x000A, 0x000B, 0x000C, 0x000D, 0x000E,
+    0x000F, 0x0010, 0x0011, 0x0012, 0x0013, 0x0015, 0x0016, 0x0018,
+    0x0019, 0x001B, 0x001C, 0x001E, 0x0020, 0x0021, 0x0023, 0x0025,
+    0x0027, 0x0029, 0x002C, 0x002E, 0x0030, 0x0033, 0x0035, 0x0038,
+    0x003A, 0x003D, 0x0040, 0x0043, 0x0046, 0x0049, 0x004D, 0x0050,
+    0x0054, 0x0057, 0x005B, 0x005F, 0x0063, 0x0067, 0x006B, 0x006F,
+    0x0074, 0x0078, 0x007D, 0x0082, 0x0087, 0x008C, 0x0091, 0x0096,
+    0x009C, 0x00A1, 0x00A7, 0x00AD, 0x00B3, 0x00BA, 0x00C0, 0x00C7,
+    0x00CD, 0x00D4, 0x00DB, 0x00E3, 0x00EA, 0x00F2, 0x00FA, 0x0101,
+    0x010A, 0x0112, 0x011B, 0x0123, 0x012C, 0x0135, 0x013F, 0x0148,
+    0x0152, 0x015C, 0x0166, 0x0171, 0x017B, 0x0186, 0x0191, 0x019C,
+    0x01A8, 0x01B4, 0x01C0, 0x01CC, 0x01D9, 0x01E5, 0x01F2, 0x0200,
+    0x020D, 0x021B, 0x0229, 0x0237, 0x0246, 0x0255, 0x0264, 0x0273,
+    0x0283, 0x0293, 0x02A3, 0x02B4, 0x02C4, 0x02D6, 0x02E7, 0x02F9,
+    0x030B, 0x031D, 0x0330, 0x0343, 0x0356, 0x036A, 0x037E, 0x0392,
+    0x03A7, 0x03BC, 0x03D1, 0x03E7, 0x03FC, 0x0413, 0x042A, 0x0441,
+    0x0458, 0x0470, 0x0488, 0x04A0, 0x04B9, 0x04D2, 0x04EC, 0x0506,
+    0x0520, 0x053B, 0x0556, 0x0572, 0x058E, 0x05AA, 0x05C7, 0x05E4,
+    0x0601, 0x061F, 0x063E, 0x065C, 0x067C, 0x069B, 0x06BB, 0x06DC,
+    0x06FD, 0x071E, 0x0740, 0x0762, 0x0784, 0x07A7, 0x07CB, 0x07EF,
+    0x0813, 0x0838, 0x085D, 0x0883, 0x08A9, 0x08D0, 0x08F7, 0x091E,
+    0x0946, 0x096F, 0x0998, 0x09C1, 0x09EB, 0x0A16, 0x0A40, 0x0A6C,
+    0x0A98, 0x0AC4, 0x0AF1, 0x0B1E, 0x0B4C, 0x0B7A, 0x0BA9, 0x0BD8,
+    0x0C07, 0x0C38, 0x0C68, 0x0C99, 0x0CCB, 0x0CFD, 0x0D30, 0x0D63,
+    0x0D97, 0x0DCB, 0x0E00, 0x0E35, 0x0E6B, 0x0EA1, 0x0ED7, 0x0F0F,
+    0x0F46, 0x0F7F, 0x0FB7, 0x0FF1, 0x102A, 0x1065, 0x109F, 0x10DB,
+    0x1116, 0x1153, 0x118F, 0x11CD, 0x120B, 0x1249, 0x1288, 0x12C7,
+    0x1307, 0x1347, 0x1388, 0x13C9, 0x140B, 0x144D, 0x1490, 0x14D4,
+    0x1517, 0x155C, 0x15A0, 0x15E6, 0x162C, 0x1672, 0x16B9, 0x1700,
+    0x1747, 0x1790, 0x17D8, 0x1821, 0x186B, 0x18B5, 0x1900, 0x194B,
+    0x1996, 0x19E2, 0x1A2E, 0x1A7B, 0x1AC8, 0x1B16, 0x1B64, 0x1BB3,
+    0x1C02, 0x1C51, 0x1CA1, 0x1CF1, 0x1D42, 0x1D93, 0x1DE5, 0x1E37,
+    0x1E89, 0x1EDC, 0x1F2F, 0x1F82, 0x1FD6, 0x202A, 0x207F, 0x20D4,
+    0x2129, 0x217F, 0x21D5, 0x222C, 0x2282, 0x22DA, 0x2331, 0x2389,
+    0x23E1, 0x2439, 0x2492, 0x24EB, 0x2545, 0x259E, 0x25F8, 0x2653,
+    0x26AD, 0x2708, 0x2763, 0x27BE, 0x281A, 0x2876, 0x28D2, 0x292E,
+    0x298B, 0x29E7, 0x2A44, 0x2AA1, 0x2AFF, 0x2B5C, 0x2BBA, 0x2C18,
+    0x2C76, 0x2CD4, 0x2D33, 0x2D91, 0x2DF0, 0x2E4F, 0x2EAE, 0x2F0D,
+    0x2F6C, 0x2FCC, 0x302B, 0x308B, 0x30EA, 0x314A, 0x31AA, 0x3209,
+    0x3269, 0x32C9, 0x3329, 0x3389, 0x33E9, 0x3449, 0x34A9, 0x3509,
+    0x3569, 0x35C9, 0x3629, 0x3689, 0x36E8, 0x3748, 0x37A8, 0x3807,
+    0x3867, 0x38C6, 0x3926, 0x3985, 0x39E4, 0x3A43, 0x3AA2, 0x3B00,
+    0x3B5F, 0x3BBD, 0x3C1B, 0x3C79, 0x3CD7, 0x3D35, 0x3D92, 0x3DEF,
+    0x3E4C, 0x3EA9, 0x3F05, 0x3F62, 0x3FBD, 0x4019, 0x4074, 0x40D0,
+    0x412A, 0x4185, 0x41DF, 0x4239, 0x4292, 0x42EB, 0x4344, 0x439C,
+    0x43F4, 0x444C, 0x44A3, 0x44FA, 0x4550, 0x45A6, 0x45FC, 0x4651,
+    0x46A6, 0x46FA, 0x474E, 0x47A1, 0x47F4, 0x4846, 0x4898, 0x48E9,
+    0x493A, 0x498A, 0x49D9, 0x4A29, 0x4A77, 0x4AC5, 0x4B13, 0x4B5F,
+    0x4BAC, 0x4BF7, 0x4C42, 0x4C8D, 0x4CD7, 0x4D20, 0x4D68, 0x4DB0,
+    0x4DF7, 0x4E3E, 0x4E84, 0x4EC9, 0x4F0E, 0x4F52, 0x4F95, 0x4FD7,
+    0x5019, 0x505A, 0x509A, 0x50DA, 0x5118, 0x5156, 0x5194, 0x51D0,
+    0x520C, 0x5247, 0x5281, 0x52BA, 0x52F3, 0x532A, 0x5361, 0x5397,
+    0x53CC, 0x5401, 0x5434, 0x5467, 0x5499, 0x54CA, 0x54FA, 0x5529,
+    0x5558, 0x5585, 0x55B2, 0x55DE, 0x5609, 0x5632, 0x565B, 0x5684,
+    0x56AB, 0x56D1, 0x56F6, 0x571B, 0x573E, 0x5761, 0x5782, 0x57A3,
+    0x57C3, 0x57E2, 0x57FF, 0x581C, 0x5838, 0x5853, 0x586D, 0x5886,
+    0x589E, 0x58B5, 0x58CB, 0x58E0, 0x58F4, 0x5907, 0x5919, 0x592A,
+    0x593A, 0x5949, 0x5958, 0x5965, 0x5971, 0x597C, 0x5986, 0x598F,
+    0x5997, 0x599E, 0x59A4, 0x59A9, 0x59AD, 0x59B0, 0x59B2, 0x59B3,
+};
+
+static int16_t gauss_interpolate(const int16_t history[4], uint32_t counter) {
+    int i = (counter >> 4) & 0xFF;
+    int32_t out = (gauss_table[0x0FF - i] * history[0]) >> 15;
+    out += (gauss_table[0x1FF - i] * history[1]) >> 15;
+    out += (gauss_table[0x100 + i] * history[2]) >> 15;
+    out += (gauss_table[i] * history[3]) >> 15;
+    if (out > +0x7FFF) out = +0x7FFF;
+    if (out < -0x8000) out = -0x8000;
+    return out;
+}
+
+static uint32_t read_vlq(const uint8_t** cursor, const uint8_t* end) {
+    uint32_t value = 0;
+    while (*cursor < end) {
+        uint8_t byte = *(*cursor)++;
+        value = (value << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0) break;
+    }
+    return value;
+}
+
+static int compare_events(const void* a, const void* b) {
+    const MidiEvent* event_a = (const MidiEvent*)a;
+    const MidiEvent* event_b = (const MidiEvent*)b;
+    if (event_a->tick != event_b->tick) return (event_a->tick < event_b->tick) ? -1 : 1;
+    return (event_a->order < event_b->order) ? -1 : (event_a->order > event_b->order);
+}
+
+// Reads all tracks of a standard MIDI file into one list of channel and tempo events, sorted by time
+static MidiEvent* load_midi(const char* path, uint32_t* n_events) {
+    uint32_t size = 0;
+    uint8_t* file = read_file(path, &size);
+    if (file == NULL) {
+        return NULL;
+    }
+    if (size < 14 || memcmp(file, "MThd", 4) != 0) {
+        printf("Invalid MIDI file\n");
+        free(file);
+        return NULL;
+    }
+    uint32_t header_size = (file[4] << 24) | (file[5] << 16) | (file[6] << 8) | file[7];
+    int n_tracks = (file[10] << 8) | file[11];
+    int division = (file[12] << 8) | file[13];
+    if (division & 0x8000) {
+        printf("SMPTE time division is not supported\n");
+        free(file);
+        return NULL;
+    }
+
+    uint32_t capacity = 4096;
+    MidiEvent* events = malloc(capacity * sizeof(MidiEvent));
+    *n_events = 0;
+
+    const uint8_t* cursor = file + 8 + header_size;
+    const uint8_t* end = file + size;
+    for (int track = 0; track < n_tracks && cursor + 8 <= end; ++track) {
+        uint32_t track_size = (cursor[4] << 24) | (cursor[5] << 16) | (cursor[6] << 8) | cursor[7];
+        const uint8_t* track_end = cursor + 8 + track_size;
+        if (track_end > end) track_end = end;
+        int is_track = (memcmp(cursor, "MTrk", 4) == 0);
+        cursor += 8;
+        if (!is_track) {
+            cursor = track_end;
+            continue;
+        }
+
+        uint64_t tick = 0;
+        uint8_t running_status = 0;
+        while (cursor < track_end) {
+            tick += read_vlq(&cursor, track_end);
+            if (cursor >= track_end) break;
+
+            uint8_t status = *cursor;
+            if (status & 0x80) {
+                cursor++;
+            } else {
+                status = running_status;
+            }
+
+            MidiEvent event = { .tick = tick, .order = *n_events, .status = status };
+            int keep = 0;
+            if (status == 0xFF) {
+                // Meta event, only tempo changes matter
+                uint8_t type = (cursor < track_end) ? *cursor++ : 0;
+                uint32_t length = read_vlq(&cursor, track_end);
+                if (type == 0x51 && length == 3 && cursor + 3 <= track_end) {
+                    event.tempo = (cursor[0] << 16) | (cursor[1] << 8) | cursor[2];
+                    keep = 1;
+                }
+                cursor += length;
+                if (type == 0x2F) break;
+            }
+            else if (status == 0xF0 || status == 0xF7) {
+                // Sysex, skip
+                uint32_t length = read_vlq(&cursor, track_end);
+                cursor += length;
+            }
+            else if (status >= 0x80) {
+                running_status = status;
+                int n_data = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+                if (cursor + n_data > track_end) break;
+                event.data1 = cursor[0];
+                event.data2 = (n_data == 2) ? cursor[1] : 0;
+                cursor += n_data;
+                keep = 1;
+            }
+            else {
+                // Data byte without a status to go with it
+                break;
+            }
+
+            if (keep) {
+                if (*n_events == capacity) {
+                    capacity *= 2;
+                    events = realloc(events, capacity * sizeof(MidiEvent));
+                }
+                events[(*n_events)++] = event;
+            }
+        }
+        cursor = track_end;
+    }
+    free(file);
+
+    // Merge the tracks, then turn ticks into seconds using the tempo map
+    qsort(events, *n_events, sizeof(MidiEvent), compare_events);
+    double time = 0.0;
+    uint64_t last_tick = 0;
+    uint32_t tempo = 500000;
+    for (uint32_t i = 0; i < *n_events; ++i) {
+        time += (double)(events[i].tick - last_tick) * tempo / (1000000.0 * division);
+        last_tick = events[i].tick;
+        events[i].time = time;
+        if (events[i].status == 0xFF) {
+            tempo = events[i].tempo;
+        }
+    }
+    return events;
+}
+
+static uint32_t ms_to_samples(uint16_t ms) {
+    return (uint32_t)((uint64_t)ms * OUTPUT_RATE / 1000);
+}
+
+static void envelope_enter(Voice* voice, EnvelopeStage stage) {
+    const InstRegion* region = voice->region;
+    voice->stage = stage;
+    voice->stage_position = 0;
+    switch (stage) {
+        case ENVELOPE_DELAY: voice->stage_length = ms_to_samples(region->delay); break;
+        case ENVELOPE_ATTACK: voice->stage_length = ms_to_samples(region->attack); break;
+        case ENVELOPE_HOLD: voice->stage_length = ms_to_samples(region->hold); break;
+        case ENVELOPE_DECAY: voice->stage_length = ms_to_samples(region->decay); break;
+        case ENVELOPE_RELEASE:
+            voice->stage_length = ms_to_samples(region->release);
+            voice->release_level = voice->level;
+            break;
+        default: voice->stage_length = 0; break;
+    }
+}
+
+// Advances the envelope by one output sample. Stage lengths are in milliseconds, every stage is linear
+static void envelope_step(Voice* voice) {
+    float sustain = voice->region->sustain / 65535.0f;
+    while (voice->stage != ENVELOPE_SUSTAIN && voice->stage != ENVELOPE_DONE && voice->stage_position >= voice->stage_length) {
+        if (voice->stage == ENVELOPE_DELAY) envelope_enter(voice, ENVELOPE_ATTACK);
+        else if (voice->stage == ENVELOPE_ATTACK) { voice->level = 1.0f; envelope_enter(voice, ENVELOPE_HOLD); }
+        else if (voice->stage == ENVELOPE_HOLD) envelope_enter(voice, ENVELOPE_DECAY);
+        else if (voice->stage == ENVELOPE_DECAY) { voice->level = sustain; envelope_enter(voice, ENVELOPE_SUSTAIN); }
+        else if (voice->stage == ENVELOPE_RELEASE) { voice->level = 0.0f; envelope_enter(voice, ENVELOPE_DONE); }
+    }
+
+    float t = (voice->stage_length > 0) ? (float)voice->stage_position / (float)voice->stage_length : 1.0f;
+    switch (voice->stage) {
+        case ENVELOPE_DELAY: voice->level = 0.0f; break;
+        case ENVELOPE_ATTACK: voice->level = t; break;
+        case ENVELOPE_HOLD: voice->level = 1.0f; break;
+        case ENVELOPE_DECAY: voice->level = 1.0f + (sustain - 1.0f) * t; break;
+        case ENVELOPE_SUSTAIN: voice->level = sustain; break;
+        case ENVELOPE_RELEASE: voice->level = voice->release_level * (1.0f - t); break;
+        default: voice->level = 0.0f; break;
+    }
+    voice->stage_position++;
+
+    // A sustain level of zero means the note is over once it has decayed
+    if (voice->stage == ENVELOPE_SUSTAIN && sustain <= 0.0f) {
+        envelope_enter(voice, ENVELOPE_DONE);
+    }
+}
+
+// Returns the next sample of the voice's sample data, following the loop flags like the SPU does
+static int16_t voice_fetch(Voice* voice, const uint8_t* ram, uint32_t ram_size, RenderStats* stats) {
+    if (voice->sample_ended) {
+        return 0;
+    }
+
+    // Signed little-endian 16-bit PCM
+    if (voice->sample->format == 1) {
+        uint32_t end = voice->sample->sample_start + voice->sample->sample_length;
+        if (voice->address + 2 > ram_size) {
+            stats->bad_samples++;
+            voice->sample_ended = 1;
+            return 0;
+        }
+        int16_t value;
+        memcpy(&value, ram + voice->address, sizeof(value));
+        voice->address += 2;
+        if (voice->address >= end) {
+            if (voice->sample->loop_start < voice->sample->sample_length) {
+                voice->address = voice->sample->sample_start + voice->sample->loop_start;
+            } else {
+                voice->sample_ended = 1;
+            }
+        }
+        return value;
+    }
+
+    // IMA-ADPCM. Every block can be decoded on its own, so several are decoded ahead at once, and a loop jumps
+    // straight to the block it starts in
+    if (voice->sample->format == 2) {
+        if (voice->frame < voice->block_frame || voice->frame >= voice->block_frame + voice->block_frames) {
+            uint32_t first_block = voice->frame / IMA_ADPCM_BLOCK_SAMPLES;
+            uint32_t total_blocks = (voice->sample->sample_length + IMA_ADPCM_BLOCK_SAMPLES - 1) / IMA_ADPCM_BLOCK_SAMPLES;
+            uint32_t address = voice->sample->sample_start + first_block * IMA_ADPCM_BLOCK_SIZE;
+            int n_blocks = IMA_DECODE_BLOCKS;
+            if (first_block + n_blocks > total_blocks) n_blocks = total_blocks - first_block;
+            while (n_blocks > 0 && address + n_blocks * IMA_ADPCM_BLOCK_SIZE > ram_size) n_blocks--;
+            if (n_blocks <= 0) {
+                stats->bad_samples++;
+                voice->sample_ended = 1;
+                return 0;
+            }
+            ima_adpcm_decode(ram + address, n_blocks, voice->block);
+            voice->block_frame = first_block * IMA_ADPCM_BLOCK_SAMPLES;
+            voice->block_frames = n_blocks * IMA_ADPCM_BLOCK_SAMPLES;
+        }
+        int16_t value = voice->block[voice->frame - voice->block_frame];
+        voice->frame++;
+        if (voice->frame >= voice->sample->sample_length) {
+            if (voice->sample->loop_start < voice->sample->sample_length) {
+                voice->frame = voice->sample->loop_start;
+            } else {
+                voice->sample_ended = 1;
+            }
+        }
+        return value;
+    }
+
+    // PSX SPU-ADPCM
+    if (voice->block_position == 28) {
+        if (voice->address + 16 > ram_size) {
+            stats->bad_samples++;
+            voice->sample_ended = 1;
+            return 0;
+        }
+        voice->block_flags = spu_adpcm_decode_block(&voice->decoder, ram + voice->address, voice->block);
+        if (voice->block_flags & PSX_AUDIO_SPU_LOOP_START) {
+            voice->loop_address = voice->address;
+        }
+        voice->block_position = 0;
+    }
+
+    int16_t value = voice->block[voice->block_position++];
+    if (voice->block_position == 28) {
+        if ((voice->block_flags & PSX_AUDIO_SPU_LOOP_END) == 0) {
+            voice->address += 16;
+        }
+        else if ((voice->block_flags & PSX_AUDIO_SPU_LOOP_REPEAT) == PSX_AUDIO_SPU_LOOP_REPEAT) {
+            voice->address = voice->loop_address;
+        }
+        else {
+            // The SPU jumps to the loop address too, but mutes the voice and releases its envelope
+            voice->sample_ended = 1;
+        }
+    }
+    return value;
+}
+
+static void voice_update_pitch(Voice* voice, const MidiChannel* channel) {
+    float pitch = voice->base_pitch * powf(2.0f, (channel->pitch_bend / 8192.0f) * 2.0f / 12.0f);
+    voice->pitch = (pitch > SPU_PITCH_MAX) ? SPU_PITCH_MAX : (uint32_t)pitch;
+}
+
+// Picks a free voice, or steals the quietest releasing voice, or else the oldest one
+static Voice* allocate_voice(Voice* voices, int n_voices, RenderStats* stats) {
+    Voice* best = NULL;
+    for (int i = 0; i < n_voices; ++i) {
+        if (!voices[i].active) {
+            return &voices[i];
+        }
+    }
+    for (int i = 0; i < n_voices; ++i) {
+        if (voices[i].stage == ENVELOPE_RELEASE && (best == NULL || voices[i].level < best->level)) {
+            best = &voices[i];
+        }
+    }
+    if (best == NULL) {
+        best = &voices[0];
+        for (int i = 1; i < n_voices; ++i) {
+            if (voices[i].started < best->started) {
+                best = &voices[i];
+            }
+        }
+    }
+    stats->voices_stolen++;
+    return best;
+}
+
+static void release_voice(Voice* voice) {
+    if (voice->stage != ENVELOPE_RELEASE && voice->stage != ENVELOPE_DONE) {
+        envelope_enter(voice, ENVELOPE_RELEASE);
+    }
+    voice->held_by_pedal = 0;
+}
+
+// Copies a bank's sample data to where a loader would put it in sample RAM, following the upload chunk table if
+// there is one. Banks without one are uploaded at `data_offset`. Chunk offsets already include the bank's place,
+// they have the same base as the sample starts
+static void upload_sample_data(const Soundbank* bank, const uint8_t* file, uint32_t file_size, uint8_t* ram, uint32_t ram_size, uint32_t data_offset) {
+    if (bank->chunk_table == NULL) {
+        memcpy(ram + data_offset, bank->sample_data, bank->header.size_sample_data);
+        return;
+    }
+    for (uint32_t i = 0; i < bank->chunk_table->n_chunks; ++i) {
+        const UploadChunk* chunk = &bank->chunks[i];
+        uint32_t size = chunk->size;
+        if (chunk->file_offset >= file_size || chunk->spu_offset >= ram_size) continue;
+        if (size > file_size - chunk->file_offset) size = file_size - chunk->file_offset;
+        if (size > ram_size - chunk->spu_offset) size = ram_size - chunk->spu_offset;
+        memcpy(ram + chunk->spu_offset, file + chunk->file_offset, size);
+    }
+}
+
+// Reads a bank, converting v2 banks to v1 so the rest of the renderer only has to deal with one format
+static uint8_t* load_bank(const char* path, uint32_t* size, Soundbank* bank) {
+    uint8_t* file = read_file(path, size);
+    if (file != NULL && *size >= 4 && memcmp(file, "FSB2", 4) == 0) {
+        uint8_t* v1_file = convert_bank_to_v1(file, *size, size);
+        free(file);
+        file = v1_file;
+    }
+    if (file == NULL || !parse_soundbank(file, *size, bank)) {
+        printf("Invalid soundbank '%s'\n", path);
+        exit(1);
+    }
+    return file;
+}
+
+static int is_absolute(const Soundbank* bank) {
+    return bank->chunk_table != NULL && (bank->chunk_table->flags & UPLOAD_CHUNKS_ABSOLUTE);
+}
+
+// End of the part of sample RAM the bank's upload chunks write to, 0 if it has no chunk table
+static uint32_t get_chunks_end(const Soundbank* bank) {
+    uint32_t end = 0;
+    for (uint32_t i = 0; bank->chunk_table != NULL && i < bank->chunk_table->n_chunks; ++i) {
+        if (bank->chunks[i].spu_offset + bank->chunks[i].size > end) {
+            end = bank->chunks[i].spu_offset + bank->chunks[i].size;
+        }
+    }
+    return end;
+}
+
+static void write_wav_header(FILE* file, uint32_t n_frames) {
+    uint32_t data_size = n_frames * 4;
+    uint32_t riff_size = 36 + data_size;
+    uint32_t fmt_size = 16;
+    uint16_t format = 1;
+    uint16_t channels = 2;
+    uint32_t rate = OUTPUT_RATE;
+    uint32_t byte_rate = OUTPUT_RATE * 4;
+    uint16_t block_align = 4;
+    uint16_t bits = 16;
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riff_size, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmt_size, 4, 1, file);
+    fwrite(&format, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&rate, 4, 1, file);
+    fwrite(&byte_rate, 4, 1, file);
+    fwrite(&block_align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&data_size, 4, 1, file);
+}
+
+int main(int argc, char** argv) {
+    // Validate input
+    if (argc < 4) {
+        printf("Usage: sbk_render.exe <.sbk> <.mid> <.wav> [options]\n");
+        printf("Options:\n");
+        printf("    --base <.sbk>           Base bank that the bank's external samples come from\n");
+        printf("    --voices <n>            Number of hardware voices (default %i)\n", SPU_VOICE_COUNT);
+        printf("    --drum-instrument <n>   Instrument that plays MIDI channel 10 (default 128)\n");
+        exit(1);
+    }
+    const char* bank_path = argv[1];
+    const char* midi_path = argv[2];
+    const char* out_path = argv[3];
+    const char* base_path = NULL;
+    int n_voices = SPU_VOICE_COUNT;
+    int drum_instrument = 128;
+    for (int arg = 4; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "--base") == 0 && arg + 1 < argc) {
+            base_path = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--voices") == 0 && arg + 1 < argc) {
+            n_voices = atoi(argv[++arg]);
+            if (n_voices < 1) n_voices = 1;
+            if (n_voices > MAX_VOICES) n_voices = MAX_VOICES;
+        }
+        else if (strcmp(argv[arg], "--drum-instrument") == 0 && arg + 1 < argc) {
+            drum_instrument = atoi(argv[++arg]) & 0xFF;
+        }
+        else {
+            printf("Unknown option '%s'\n", argv[arg]);
+            exit(1);
+        }
+    }
+
+    // Load the bank, and the base bank if it has one
+    Soundbank bank;
+    Soundbank base = { 0 };
+    uint32_t bank_size = 0;
+    uint32_t base_size = 0;
+    uint8_t* bank_file = load_bank(bank_path, &bank_size, &bank);
+    uint8_t* base_file = NULL;
+    if (base_path != NULL) {
+        base_file = load_bank(base_path, &base_size, &base);
+    }
+
+    // Lay out sample RAM like the loader would: banks placed with an SPU memory map go to their absolute addresses,
+    // otherwise the base bank's data comes first and this bank's data after it
+    uint32_t bank_data_offset = (base_file != NULL) ? ((base.header.size_sample_data + 15) & ~15) : 0;
+    uint32_t ram_size = bank_data_offset + bank.header.size_sample_data + DMA_BLOCK_SIZE;
+    if (get_chunks_end(&bank) > ram_size) {
+        ram_size = get_chunks_end(&bank);
+    }
+    if (is_absolute(&bank) || (base_file != NULL && is_absolute(&base))) {
+        ram_size = SPU_RAM_SIZE;
+    }
+    uint8_t* ram = calloc(ram_size + 16, 1);
+    if (base_file != NULL) {
+        upload_sample_data(&base, base_file, base_size, ram, ram_size, 0);
+    }
+    upload_sample_data(&bank, bank_file, bank_size, ram, ram_size, bank_data_offset);
+
+    uint32_t n_events = 0;
+    MidiEvent* events = load_midi(midi_path, &n_events);
+    if (events == NULL) {
+        return 1;
+    }
+
+    FILE* out_file = fopen(out_path, "wb");
+    if (out_file == NULL) {
+        printf("Failed to open file '%s'\n", out_path);
+        return 1;
+    }
+    write_wav_header(out_file, 0);
+
+    Voice* voices = calloc(n_voices, sizeof(Voice));
+    MidiChannel channels[16];
+    for (int i = 0; i < 16; ++i) {
+        channels[i] = (MidiChannel){ .program = 0, .volume = 100, .expression = 127, .pan = 64, .sustain_pedal = 0, .pitch_bend = 0 };
+    }
+    RenderStats stats = { 0 };
+    uint64_t voice_order = 0;
+
+    // Render in between events
+    const int mix_size = 1024;
+    float mix[1024 * 2];
+    int16_t output[1024 * 2];
+    uint64_t n_frames = 0;
+    uint32_t next_event = 0;
+    uint64_t tail_limit = (n_events > 0) ? (uint64_t)((events[n_events - 1].time + MAX_TAIL_SECONDS) * OUTPUT_RATE) : 0;
+    clock_t render_start = clock();
+    while (1) {
+        // Apply all events that are due
+        while (next_event < n_events && (uint64_t)(events[next_event].time * OUTPUT_RATE) <= n_frames) {
+            const MidiEvent* event = &events[next_event++];
+            int type = event->status & 0xF0;
+            MidiChannel* channel = &channels[event->status & 0x0F];
+            int channel_index = event->status & 0x0F;
+
+            if (type == 0x90 && event->data2 > 0) {
+                stats.note_ons++;
+                int instrument_id = (channel_index == 9) ? drum_instrument : channel->program;
+                const InstDesc* inst = &bank.inst_descs[instrument_id];
+                int matched = 0;
+                for (int r = inst->region_start_index; r < inst->region_start_index + inst->n_regions; ++r) {
+                    const InstRegion* region = &bank.regions[r];
+                    if (event->data1 < region->key_min || event->data1 > region->key_max) {
+                        continue;
+                    }
+                    matched = 1;
+
+                    // Find the sample, which might live in the base bank
+                    const SampleHeader* sample = NULL;
+                    uint16_t sample_index = region->sample_index & ~SAMPLE_INDEX_EXTERNAL;
+                    if ((region->sample_index & SAMPLE_INDEX_EXTERNAL) == 0 && sample_index < bank.header.n_samples) {
+                        sample = &bank.sample_headers[sample_index];
+                    }
+                    else if ((region->sample_index & SAMPLE_INDEX_EXTERNAL) && base_file != NULL && sample_index < base.header.n_samples) {
+                        sample = &base.sample_headers[sample_index];
+                    }
+                    if (sample == NULL || sample->sample_start >= ram_size) {
+                        stats.bad_samples++;
+                        continue;
+                    }
+
+                    Voice* voice = allocate_voice(voices, n_voices, &stats);
+                    memset(voice, 0, sizeof(Voice));
+                    voice->active = 1;
+                    voice->channel = channel_index;
+                    voice->key = event->data1;
+                    voice->started = voice_order++;
+                    voice->sample = sample;
+                    voice->region = region;
+                    voice->address = sample->sample_start;
+                    voice->loop_address = sample->sample_start;
+                    voice->block_position = 28;
+                    voice->base_pitch = sample->sample_rate * 4096.0f / OUTPUT_RATE * powf(2.0f, (event->data1 - 60) / 12.0f);
+                    voice_update_pitch(voice, channel);
+
+                    float volume = (event->data2 / 127.0f) * (region->volume / REGION_VOLUME_MAX);
+                    float pan = (region->panning - 127) / 127.0f + (channel->pan - 64) / 64.0f;
+                    if (pan < -1.0f) pan = -1.0f;
+                    if (pan > 1.0f) pan = 1.0f;
+                    voice->volume_left = volume * ((pan > 0.0f) ? (1.0f - pan) : 1.0f);
+                    voice->volume_right = volume * ((pan < 0.0f) ? (1.0f + pan) : 1.0f);
+                    envelope_enter(voice, ENVELOPE_DELAY);
+                    stats.voices_started++;
+                }
+                if (!matched) {
+                    stats.unmatched_notes++;
+                }
+            }
+            else if (type == 0x80 || type == 0x90) {
+                for (int v = 0; v < n_voices; ++v) {
+                    if (voices[v].active && voices[v].channel == channel_index && voices[v].key == event->data1 && voices[v].stage != ENVELOPE_RELEASE) {
+                        if (channel->sustain_pedal) voices[v].held_by_pedal = 1;
+                        else release_voice(&voices[v]);
+                    }
+                }
+            }
+            else if (type == 0xB0) {
+                if (event->data1 == 7) channel->volume = event->data2;
+                else if (event->data1 == 10) channel->pan = event->data2;
+                else if (event->data1 == 11) channel->expression = event->data2;
+                else if (event->data1 == 64) {
+                    channel->sustain_pedal = event->data2 >= 64;
+                    for (int v = 0; v < n_voices && !channel->sustain_pedal; ++v) {
+                        if (voices[v].active && voices[v].channel == channel_index && voices[v].held_by_pedal) {
+                            release_voice(&voices[v]);
+                        }
+                    }
+                }
+                else if (event->data1 == 120 || event->data1 == 123) {
+                    for (int v = 0; v < n_voices; ++v) {
+                        if (voices[v].active && voices[v].channel == channel_index) {
+                            release_voice(&voices[v]);
+                        }
+                    }
+                }
+            }
+            else if (type == 0xC0) {
+                channel->program = event->data1;
+            }
+            else if (type == 0xE0) {
+                channel->pitch_bend = (int16_t)(((event->data2 << 7) | event->data1) - 8192);
+                for (int v = 0; v < n_voices; ++v) {
+                    if (voices[v].active && voices[v].channel == channel_index) {
+                        voice_update_pitch(&voices[v], channel);
+                    }
+                }
+            }
+        }
+
+        // Stop once the song is over and every voice has finished
+        int n_active = 0;
+        for (int v = 0; v < n_voices; ++v) {
+            n_active += voices[v].active;
+        }
+        if ((next_event >= n_events && n_active == 0) || n_frames >= tail_limit) {
+            break;
+        }
+
+        // Render up to the next event
+        uint64_t frames_to_render = mix_size;
+        if (next_event < n_events) {
+            uint64_t event_frame = (uint64_t)(events[next_event].time * OUTPUT_RATE);
+            if (event_frame - n_frames < frames_to_render) frames_to_render = event_frame - n_frames;
+        }
+
+        memset(mix, 0, sizeof(mix));
+        for (uint64_t f = 0; f < frames_to_render; ++f) {
+            int voices_this_frame = 0;
+            for (int v = 0; v < n_voices; ++v) {
+                Voice* voice = &voices[v];
+                if (!voice->active) continue;
+
+                envelope_step(voice);
+                if (voice->stage == ENVELOPE_DONE || voice->sample_ended) {
+                    voice->active = 0;
+                    continue;
+                }
+                voices_this_frame++;
+
+                // Interpolate, then advance the pitch counter and feed in the samples it passed
+                int16_t sample = gauss_interpolate(voice->history, voice->counter);
+                voice->counter += voice->pitch;
+                while (voice->counter >= 0x1000) {
+                    voice->counter -= 0x1000;
+                    voice->history[0] = voice->history[1];
+                    voice->history[1] = voice->history[2];
+                    voice->history[2] = voice->history[3];
+                    voice->history[3] = voice_fetch(voice, ram, ram_size, &stats);
+                }
+
+                const MidiChannel* channel = &channels[voice->channel];
+                float gain = voice->level * (channel->volume / 127.0f) * (channel->expression / 127.0f);
+                mix[f * 2 + 0] += sample * gain * voice->volume_left;
+                mix[f * 2 + 1] += sample * gain * voice->volume_right;
+            }
+
+            stats.voice_samples += voices_this_frame;
+            if (voices_this_frame > stats.peak_voices) {
+                stats.peak_voices = voices_this_frame;
+                stats.peak_voices_time = (double)(n_frames + f) / OUTPUT_RATE;
+            }
+        }
+
+        for (uint64_t i = 0; i < frames_to_render * 2; ++i) {
+            float value = mix[i];
+            if (value > 32767.0f) value = 32767.0f;
+            if (value < -32768.0f) value = -32768.0f;
+            output[i] = (int16_t)value;
+        }
+        fwrite(output, sizeof(int16_t) * 2, frames_to_render, out_file);
+        n_frames += frames_to_render;
+    }
+    double render_seconds = (double)(clock() - render_start) / CLOCKS_PER_SEC;
+
+    // Now that the length is known, fix up the header
+    fseek(out_file, 0, SEEK_SET);
+    write_wav_header(out_file, (uint32_t)n_frames);
+    fclose(out_file);
+
+    // Report
+    double song_seconds = (double)n_frames / OUTPUT_RATE;
+    printf("Rendered %.2f s of audio in %.3f s (%.1fx real time)\n", song_seconds, render_seconds, (render_seconds > 0.0) ? song_seconds / render_seconds : 0.0);
+    printf("Note-ons:           %llu (%llu without a matching region)\n", (unsigned long long)stats.note_ons, (unsigned long long)stats.unmatched_notes);
+    printf("Voices started:     %llu (%llu stolen)\n", (unsigned long long)stats.voices_started, (unsigned long long)stats.voices_stolen);
+    printf("Peak voices:        %i of %i (at %.2f s)\n", stats.peak_voices, n_voices, stats.peak_voices_time);
+    printf("Average voices:     %.2f\n", (n_frames > 0) ? (double)stats.voice_samples / n_frames : 0.0);
+    printf("Voice throughput:   %.0f voice-samples/s\n", (render_seconds > 0.0) ? stats.voice_samples / render_seconds : 0.0);
+    if (stats.bad_samples > 0) {
+        printf("Bad samples:        %llu voices referenced missing or out of range sample data\n", (unsigned long long)stats.bad_samples);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+#ifndef SOUNDBANK
+#define SOUNDBANK
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// File layout: BankHeader, followed by the instrument descriptors, the region table, the sample headers and the sample data
+typedef struct {
+    char magic[4];                  // "FSBK"
+    uint32_t n_samples;             // Number of entries in the sample header table
+    uint32_t offset_inst_descs;     // Offset (bytes) of the instrument descriptors, relative to the end of this header
+    uint32_t offset_region_table;   // Offset (bytes) of the region table, relative to the end of this header
+    uint32_t offset_sample_headers; // Offset (bytes) of the sample header table, relative to the end of this header
+    uint32_t offset_sample_data;    // Offset (bytes) of the sample data chunk, relative to the end of this header
+    uint32_t size_sample_data;      // Size (bytes) of the sample data chunk
+} BankHeader;
+
+typedef struct {
+    uint16_t region_start_index;    // Index of this instrument's first region in the region table
+    uint16_t n_regions;             // Number of regions, 0 if the instrument is not in this bank
+} InstDesc;
+
+typedef struct {
+    uint32_t sample_start;  // Offset (bytes) into sample data chunk. Can be written to SPU Sample Start Address. For dependent banks, the offset is relative to the base bank's sample data chunk, and this bank's own chunk follows it, aligned to 16 bytes (64 bytes if the bank has an upload chunk table). If the upload chunk table has UPLOAD_CHUNKS_ABSOLUTE set, this is an absolute SPU RAM address instead
+    uint32_t sample_length; // Length of this sample, in frames for formats 0 and 2 and in bytes for format 1. If `loop_start` is not equal to UINT32_MAX, this determines when to jump back to loop_start.
+    uint32_t sample_rate;   // Sample rate (Hz) at MIDI key 60 (C5)
+    uint32_t loop_start;    // Offset relative to sample start to return to after the end of a sample, in the same unit as `sample_length`
+    uint32_t format;        // 0 = PSX SPU-ADPCM, 1 = Signed little-endian 16-bit PCM, 2 = IMA-ADPCM in 64-byte blocks (see codec.h)
+} SampleHeader;
+
+typedef struct {
+    uint16_t sample_index;  // Index into sample header array, or into the base bank's sample header array if SAMPLE_INDEX_EXTERNAL is set
+    uint16_t delay;         // Delay stage length in milliseconds
+    uint16_t attack;        // Attack stage length in milliseconds
+    uint16_t hold;          // Hold stage length in milliseconds
+    uint16_t decay;         // Decay stage length in milliseconds
+    uint16_t sustain;       // Sustain volume where 0 = 0.0 and 65535 = 1.0
+    uint16_t release;       // Release stage length in milliseconds
+    uint16_t volume;        // Panning for this region, 0 = left, 127 = middle, 254 = right
+    uint16_t panning;       // Panning for this region, 0 = left, 127 = middle, 254 = right
+    uint8_t key_min;        // Minimum MIDI key for this instrument region
+    uint8_t key_max;        // Maximum MIDI key for this instrument region         
+} InstRegion;
+
+#define SAMPLE_INDEX_EXTERNAL 0x8000
+
+#define CD_SECTOR_SIZE 2048
+#define DMA_BLOCK_SIZE 64           // SPU DMA transfers are done in blocks of 16 words
+#define SPU_RAM_SIZE (512 * 1024)
+
+#define UPLOAD_CHUNKS_ABSOLUTE 1    // Sample starts and chunk SPU offsets are absolute SPU RAM addresses
+
+// With --align-sectors or --spu-map, this table sits between the sample headers and the sample data, at the first
+// 64-byte boundary (counted from the start of the file) after the sample headers. Loaders that don't know about it
+// simply skip it
+typedef struct {
+    char magic[4];          // "CHNK"
+    uint32_t n_chunks;      // Number of UploadChunk entries that follow
+    uint32_t flags;         // UPLOAD_CHUNKS_*
+} UploadChunkTable;
+
+typedef struct {
+    uint32_t file_offset;   // Offset (bytes) from the start of the file, a multiple of 2048 with --align-sectors
+    uint32_t spu_offset;    // Where to transfer this chunk to, relative to the same base as SampleHeader.sample_start
+    uint32_t size;          // Number of bytes to transfer, a multiple of 64. Can be read straight into a DMA buffer
+} UploadChunk;
+
+// A bank read back from a file. All pointers point into the file's data
+typedef struct {
+    BankHeader header;
+    const InstDesc* inst_descs;         // Always 256 entries
+    const InstRegion* regions;
+    uint32_t n_regions;
+    const SampleHeader* sample_headers;
+    const uint8_t* sample_data;
+    const UploadChunkTable* chunk_table; // NULL if the bank doesn't have one
+    const UploadChunk* chunks;
+} Soundbank;
+
+uint8_t* read_file(const char* path, uint32_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Failed to open file '%s'\n", path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* data = malloc(*size + 1);
+    fread(data, 1, *size, file);
+    fclose(file);
+    return data;
+}
+
+// Where the upload chunk table goes, relative to the end of the header. There is one if it fits before the sample data
+uint32_t get_chunk_table_offset(const BankHeader* header) {
+    uint32_t end_sample_headers = sizeof(BankHeader) + header->offset_sample_headers + header->n_samples * sizeof(SampleHeader);
+    return (end_sample_headers + DMA_BLOCK_SIZE - 1) / DMA_BLOCK_SIZE * DMA_BLOCK_SIZE - sizeof(BankHeader);
+}
+
+// Reads the tables out of a .sbk file. Returns 0 if it isn't a valid bank
+int parse_soundbank(const uint8_t* file, uint32_t size, Soundbank* bank) {
+    if (size < sizeof(BankHeader)) {
+        return 0;
+    }
+    memcpy(&bank->header, file, sizeof(BankHeader));
+    const BankHeader* header = &bank->header;
+    if (memcmp(header->magic, "FSBK", 4) != 0
+        || sizeof(BankHeader) + header->offset_inst_descs + 256 * sizeof(InstDesc) > size
+        || sizeof(BankHeader) + header->offset_sample_headers + header->n_samples * sizeof(SampleHeader) > size
+        || sizeof(BankHeader) + header->offset_sample_data + header->size_sample_data > size) {
+        return 0;
+    }
+
+    const uint8_t* tables = file + sizeof(BankHeader);
+    bank->inst_descs = (const InstDesc*)(tables + header->offset_inst_descs);
+    bank->regions = (const InstRegion*)(tables + header->offset_region_table);
+    bank->sample_headers = (const SampleHeader*)(tables + header->offset_sample_headers);
+    bank->sample_data = tables + header->offset_sample_data;
+
+    // The region table can be followed by padding, so count the regions the instruments actually use
+    bank->n_regions = 0;
+    for (int i = 0; i < 256; ++i) {
+        uint32_t end = bank->inst_descs[i].region_start_index + bank->inst_descs[i].n_regions;
+        if (bank->inst_descs[i].n_regions > 0 && end > bank->n_regions) {
+            bank->n_regions = end;
+        }
+    }
+    if (sizeof(BankHeader) + header->offset_region_table + bank->n_regions * sizeof(InstRegion) > size) {
+        return 0;
+    }
+
+    // The upload chunk table, if any, sits at a fixed place between the sample headers and the sample data
+    bank->chunk_table = NULL;
+    bank->chunks = NULL;
+    uint32_t offset = get_chunk_table_offset(header);
+    if (offset + sizeof(UploadChunkTable) <= header->offset_sample_data && memcmp(tables + offset, "CHNK", 4) == 0) {
+        bank->chunk_table = (const UploadChunkTable*)(tables + offset);
+        bank->chunks = (const UploadChunk*)(tables + offset + sizeof(UploadChunkTable));
+        if (offset + sizeof(UploadChunkTable) + bank->chunk_table->n_chunks * sizeof(UploadChunk) > header->offset_sample_data) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#endif
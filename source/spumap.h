@@ -0,0 +1,178 @@
+#ifndef SPUMAP
+#define SPUMAP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "soundbank.h"
+
+#define SPU_MAP_MAX_REGIONS 64
+#define SPU_MAP_MAX_SPANS (SPU_MAP_MAX_REGIONS + 1)
+#define SPU_CAPTURE_BUFFERS_SIZE 0x1000 // CD audio left/right and voice 1/3 capture buffers, written by the SPU all the time
+
+// Reverb work area sizes (bytes). The work area always sits at the very end of SPU RAM
+typedef struct {
+    const char* name;
+    uint32_t size;
+} ReverbMode;
+
+static const ReverbMode reverb_modes[] = {
+    { "off",            0x00010 },
+    { "room",           0x026C0 },
+    { "studio_small",   0x01F40 },
+    { "studio_medium",  0x04840 },
+    { "studio_large",   0x06FE0 },
+    { "hall",           0x0ADE0 },
+    { "space",          0x0F6C0 },
+    { "echo",           0x18040 },
+    { "delay",          0x18040 },
+    { "half_echo",      0x03C00 },
+};
+
+typedef struct {
+    uint32_t start;         // SPU RAM address (bytes)
+    uint32_t end;           // SPU RAM address (bytes) of the first byte after the region
+    char name[32];
+} SpuRegion;
+
+// Everything in SPU RAM that soundbanks have to stay clear of
+typedef struct {
+    SpuRegion reserved[SPU_MAP_MAX_REGIONS];
+    int n_reserved;
+} SpuMap;
+
+static void spu_map_reserve(SpuMap* map, uint32_t start, uint32_t end, const char* name) {
+    SpuRegion* region = &map->reserved[map->n_reserved++];
+    region->start = start;
+    region->end = end;
+    snprintf(region->name, sizeof(region->name), "%s", name);
+}
+
+// Parses an SPU RAM address, in decimal or with a 0x prefix in hex. Returns 0 if it isn't a number up to SPU_RAM_SIZE
+static int parse_spu_address(const char* string, uint32_t* address) {
+    char* end = NULL;
+    unsigned long parsed = strtoul(string, &end, 0);
+    if (end == string || *end != 0 || string[0] == '-' || parsed > SPU_RAM_SIZE) {
+        return 0;
+    }
+    *address = (uint32_t)parsed;
+    return 1;
+}
+
+// Reads an SPU memory map. Every line is one of:
+//     reverb <mode>                   Reserve the work area of a reverb mode, e.g. "reverb hall"
+//     reserve <start> <end> <name>    Reserve [start, end), e.g. for resident sound effects
+// The capture buffers are always reserved. Returns 0 on failure
+int load_spu_map(const char* path, SpuMap* map) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Failed to open file '%s'\n", path);
+        return 0;
+    }
+
+    map->n_reserved = 0;
+    spu_map_reserve(map, 0, SPU_CAPTURE_BUFFERS_SIZE, "capture buffers");
+
+    char line[256];
+    int line_number = 0;
+    int reverb_set = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char keyword[32] = { 0 };
+        if (sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#')
+            continue;
+
+        char name[32] = { 0 };
+        char start_str[32] = { 0 };
+        char end_str[32] = { 0 };
+        if (strcmp(keyword, "reverb") == 0 && sscanf(line, "%*s %31s", name) == 1) {
+            if (reverb_set) {
+                printf("%s:%i: reverb already set\n", path, line_number);
+                fclose(file);
+                return 0;
+            }
+            int mode = 0;
+            while (mode < (int)(sizeof(reverb_modes) / sizeof(reverb_modes[0])) && strcmp(reverb_modes[mode].name, name) != 0) {
+                mode++;
+            }
+            if (mode == (int)(sizeof(reverb_modes) / sizeof(reverb_modes[0]))) {
+                printf("%s:%i: unknown reverb mode '%s'\n", path, line_number, name);
+                fclose(file);
+                return 0;
+            }
+            char region_name[32];
+            snprintf(region_name, sizeof(region_name), "reverb (%s)", reverb_modes[mode].name);
+            spu_map_reserve(map, SPU_RAM_SIZE - reverb_modes[mode].size, SPU_RAM_SIZE, region_name);
+            reverb_set = 1;
+        }
+        else if (strcmp(keyword, "reserve") == 0 && sscanf(line, "%*s %31s %31s %31s", start_str, end_str, name) == 3) {
+            if (map->n_reserved == SPU_MAP_MAX_REGIONS) {
+                printf("%s:%i: too many reserved regions\n", path, line_number);
+                fclose(file);
+                return 0;
+            }
+            uint32_t start = 0;
+            uint32_t end = 0;
+            if (!parse_spu_address(start_str, &start) || !parse_spu_address(end_str, &end)) {
+                printf("%s:%i: invalid address in '%s'\n", path, line_number, strtok(line, "\r\n"));
+                fclose(file);
+                return 0;
+            }
+            if (start >= end || end > SPU_RAM_SIZE) {
+                printf("%s:%i: invalid region 0x%05X-0x%05X\n", path, line_number, start, end);
+                fclose(file);
+                return 0;
+            }
+            spu_map_reserve(map, start, end, name);
+        }
+        else {
+            printf("%s:%i: can't parse '%s'\n", path, line_number, strtok(line, "\r\n"));
+            fclose(file);
+            return 0;
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+// Finds the gaps between the reserved regions, sorted by address. Gaps are shrunk to whole DMA blocks, so uploads
+// never touch reserved memory. Returns the number of gaps
+int get_spu_free_spans(const SpuMap* map, SpuRegion* spans, int max_spans) {
+    int n_spans = 0;
+    uint32_t address = 0;
+    while (address < SPU_RAM_SIZE && n_spans < max_spans) {
+        // Skip past whatever is reserved here
+        int moved = 1;
+        while (moved) {
+            moved = 0;
+            for (int i = 0; i < map->n_reserved; ++i) {
+                if (map->reserved[i].start <= address && map->reserved[i].end > address) {
+                    address = map->reserved[i].end;
+                    moved = 1;
+                }
+            }
+        }
+
+        // The gap ends where the next reserved region starts
+        uint32_t end = SPU_RAM_SIZE;
+        for (int i = 0; i < map->n_reserved; ++i) {
+            if (map->reserved[i].start > address && map->reserved[i].start < end) {
+                end = map->reserved[i].start;
+            }
+        }
+        if (address >= SPU_RAM_SIZE) {
+            break;
+        }
+
+        uint32_t start = (address + DMA_BLOCK_SIZE - 1) & ~(DMA_BLOCK_SIZE - 1);
+        uint32_t aligned_end = end & ~(DMA_BLOCK_SIZE - 1);
+        if (aligned_end > start) {
+            spans[n_spans] = (SpuRegion){ .start = start, .end = aligned_end, .name = "free" };
+            n_spans++;
+        }
+        address = end;
+    }
+    return n_spans;
+}
+#endif
@@ -5,6 +5,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_IEEE_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+#define WAV_CHANNEL_MIX -1 // Average all channels together instead of picking one
 
 typedef struct {
     uint16_t audio_format;    // Audio format (1 for PCM)
@@ -36,14 +46,31 @@ typedef struct {
   int32_t  play_count;
 } SampleLoop;
 
+typedef struct {
+    uint32_t id;
+    uint32_t position;      // Frame the cue point (or AIFF marker) sits before
+} WaveCue;
+
 typedef struct {
     int16_t* samples;
     uint32_t sample_rate;
     int length;
     int loop_start;
     int loop_end;
+    WaveCue* cues;
+    int n_cues;
+    int num_channels;       // Number of channels in the file, `samples` always holds one
 } WaveFile;
 
+// How the frames in a PCM data chunk are stored
+typedef struct {
+    int num_channels;
+    int bits_per_sample;
+    int is_float;
+    int is_big_endian;
+    int is_unsigned;          // 8-bit WAV data is unsigned, everything else is signed
+} PcmLayout;
+
 int read_riff_chunk(FILE** file, char* name, uint32_t* size) {
     // Read name of chunk and add null terminator
     fread(name, 4, 1, *file);
@@ -60,7 +87,151 @@ int read_riff_chunk(FILE** file, char* name, uint32_t* size) {
     return 1;
 }
 
-WaveFile load_wav(const char* path) {
+static uint32_t read_u32_be(const uint8_t* data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+}
+
+static uint16_t read_u16_be(const uint8_t* data) {
+    return (uint16_t)((data[0] << 8) | data[1]);
+}
+
+// Reads one sample and scales it to [-1.0, 1.0)
+static float read_pcm_value(const uint8_t* data, const PcmLayout* layout) {
+    int n_bytes = layout->bits_per_sample / 8;
+    uint8_t bytes[8];
+    for (int i = 0; i < n_bytes; ++i) {
+        bytes[i] = layout->is_big_endian ? data[n_bytes - 1 - i] : data[i];
+    }
+
+    if (layout->is_float) {
+        if (n_bytes == 8) {
+            double value;
+            memcpy(&value, bytes, sizeof(value));
+            return (float)value;
+        }
+        float value;
+        memcpy(&value, bytes, sizeof(value));
+        return value;
+    }
+
+    // Put the sample in the top bits of a 32-bit integer, so every bit depth ends up on the same scale
+    uint32_t raw = 0;
+    for (int i = 0; i < n_bytes; ++i) {
+        raw |= (uint32_t)bytes[i] << (32 - 8 * n_bytes + 8 * i);
+    }
+    if (layout->is_unsigned) {
+        raw ^= 0x80000000u;
+    }
+    return (float)(int32_t)raw * (1.0f / 2147483648.0f);
+}
+
+// Converts interleaved frames to mono floats, either by picking `channel` or by averaging all channels
+void pcm_to_float_mono(const uint8_t* data, int n_frames, const PcmLayout* layout, int channel, float* out) {
+    int sample_size = layout->bits_per_sample / 8;
+    int frame_size = sample_size * layout->num_channels;
+    for (int i = 0; i < n_frames; ++i) {
+        const uint8_t* frame = data + (size_t)i * frame_size;
+        if (channel != WAV_CHANNEL_MIX) {
+            out[i] = read_pcm_value(frame + channel * sample_size, layout);
+            continue;
+        }
+        float sum = 0.0f;
+        for (int c = 0; c < layout->num_channels; ++c) {
+            sum += read_pcm_value(frame + c * sample_size, layout);
+        }
+        out[i] = sum / (float)layout->num_channels;
+    }
+}
+
+static uint32_t xorshift32(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Converts floats in [-1.0, 1.0) to 16-bit with round-to-nearest and saturation. With `dither` set, triangular
+// (TPDF) noise of +-1 LSB is added first. The noise is seeded the same every time, so builds stay reproducible.
+void float_to_int16(const float* in, int16_t* out, int n, int dither) {
+    int i = 0;
+    uint32_t rng = 0x2545F491u;
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 to_unit = _mm_set1_ps(1.0f / 16777216.0f);
+    __m128i rng_lanes = _mm_set_epi32(0x9E3779B9, 0x85EBCA6B, 0xC2B2AE35, 0x27D4EB2F);
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+        if (dither) {
+            // Four xorshift32 generators side by side, the difference of two uniform values gives a triangular distribution
+            __m128 uniform[4];
+            for (int j = 0; j < 4; ++j) {
+                rng_lanes = _mm_xor_si128(rng_lanes, _mm_slli_epi32(rng_lanes, 13));
+                rng_lanes = _mm_xor_si128(rng_lanes, _mm_srli_epi32(rng_lanes, 17));
+                rng_lanes = _mm_xor_si128(rng_lanes, _mm_slli_epi32(rng_lanes, 5));
+                uniform[j] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(rng_lanes, 8)), to_unit);
+            }
+            a = _mm_add_ps(a, _mm_sub_ps(uniform[0], uniform[1]));
+            b = _mm_add_ps(b, _mm_sub_ps(uniform[2], uniform[3]));
+        }
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128((__m128i*)(out + i), packed);
+    }
+#endif
+    for (; i < n; ++i) {
+        float value = in[i] * 32768.0f;
+        if (dither) {
+            float u1 = (float)(xorshift32(&rng) >> 8) * (1.0f / 16777216.0f);
+            float u2 = (float)(xorshift32(&rng) >> 8) * (1.0f / 16777216.0f);
+            value += u1 - u2;
+        }
+        value = rintf(value);
+        if (value > 32767.0f) value = 32767.0f;
+        if (value < -32768.0f) value = -32768.0f;
+        out[i] = (int16_t)value;
+    }
+}
+
+// Turns a raw data chunk into mono 16-bit samples. Returns the number of frames, or -1 if the layout isn't supported
+// or `channel` doesn't exist
+static int convert_pcm_data(const uint8_t* data, uint32_t size, const PcmLayout* layout, int channel, int dither, int16_t** samples) {
+    int valid_int = !layout->is_float && (layout->bits_per_sample == 8 || layout->bits_per_sample == 16 || layout->bits_per_sample == 24 || layout->bits_per_sample == 32);
+    int valid_float = layout->is_float && (layout->bits_per_sample == 32 || layout->bits_per_sample == 64);
+    if (!valid_int && !valid_float) {
+        printf("Unsupported sample format: %i-bit %s\n", layout->bits_per_sample, layout->is_float ? "float" : "integer");
+        return -1;
+    }
+    if (layout->num_channels < 1 || (channel != WAV_CHANNEL_MIX && (channel < 0 || channel >= layout->num_channels))) {
+        return -1;
+    }
+
+    int frame_size = layout->num_channels * layout->bits_per_sample / 8;
+    int n_frames = size / frame_size;
+    *samples = (int16_t*)malloc(n_frames * sizeof(int16_t) + 1);
+
+    // 16-bit data doesn't need converting, only picking a channel and byte swapping
+    int downmix = (channel == WAV_CHANNEL_MIX && layout->num_channels > 1);
+    if (!layout->is_float && layout->bits_per_sample == 16 && !downmix) {
+        int picked = (channel == WAV_CHANNEL_MIX) ? 0 : channel;
+        for (int i = 0; i < n_frames; ++i) {
+            const uint8_t* bytes = data + (size_t)i * frame_size + picked * 2;
+            (*samples)[i] = layout->is_big_endian ? (int16_t)((bytes[0] << 8) | bytes[1]) : (int16_t)((bytes[1] << 8) | bytes[0]);
+        }
+        return n_frames;
+    }
+
+    // Only dither when precision is actually lost, 8-bit samples fit in 16 bits exactly
+    int reduces_precision = layout->is_float || layout->bits_per_sample > 16 || downmix;
+    float* mono = (float*)malloc(n_frames * sizeof(float) + 1);
+    pcm_to_float_mono(data, n_frames, layout, channel, mono);
+    float_to_int16(mono, *samples, n_frames, dither && reduces_precision);
+    free(mono);
+    return n_frames;
+}
+
+WaveFile load_wav(const char* path, int channel, int dither) {
     // We will gather this information
     WavHeader header;
     SamplerChunk sampler;
@@ -70,7 +241,13 @@ WaveFile load_wav(const char* path) {
         .length = -1,
         .loop_start = -1,
         .loop_end = -1,
+        .cues = NULL,
+        .n_cues = 0,
+        .num_channels = 0,
     };
+    PcmLayout layout = { 0 };
+    uint8_t* data = NULL;
+    uint32_t data_size = 0;
 
     // Open file
     FILE* file = fopen(path, "rb");
@@ -78,7 +255,7 @@ WaveFile load_wav(const char* path) {
         printf("Failed to open file %s\n", path);
         return wave;
     }
-    
+
     char name[5] = {0};
     uint32_t size;
 
@@ -95,30 +272,39 @@ WaveFile load_wav(const char* path) {
 
     while(1) {
         if (!read_riff_chunk(&file, name, &size)) break;
+        long chunk_end = ftell(file) + size + (size & 1); // Chunks are padded to an even size
 
         // Sample metadata
         if (strcmp(name, "fmt ") == 0) {
             // Read header
             fread(&header, sizeof(header), 1, file);
 
-            // Do we support this? if not, bail
-            if (header.num_channels != 1) {
-                printf("Only mono samples are supported for now!");
-                return wave;
+            // WAVE_FORMAT_EXTENSIBLE keeps the actual format in the first two bytes of the sub-format GUID
+            uint16_t audio_format = header.audio_format;
+            if (audio_format == WAV_FORMAT_EXTENSIBLE && size >= 26) {
+                fseek(file, 8, SEEK_CUR);
+                fread(&audio_format, sizeof(audio_format), 1, file);
             }
-            if (header.bits_per_sample != 16) {
-                printf("Only 16-bit samples are supported for now!");
+
+            // Do we support this? if not, bail
+            if (audio_format != WAV_FORMAT_PCM && audio_format != WAV_FORMAT_IEEE_FLOAT) {
+                printf("Only PCM and IEEE float samples are supported!\n");
+                fclose(file);
                 return wave;
             }
 
+            layout.num_channels = header.num_channels;
+            layout.bits_per_sample = header.bits_per_sample;
+            layout.is_float = (audio_format == WAV_FORMAT_IEEE_FLOAT);
+            layout.is_big_endian = 0;
+            layout.is_unsigned = (header.bits_per_sample == 8);
             wave.sample_rate = header.sample_rate;
         }
 
         // Wave data
         else if (strcmp(name, "data") == 0) {
-            wave.samples = (int16_t*)malloc(size);
-            fread(wave.samples, 1, size, file);
-            wave.length = size / 2;
+            data = (uint8_t*)malloc(size + 1);
+            data_size = fread(data, 1, size, file);
         }
 
         // Sampler info (e.g. loop points)
@@ -130,15 +316,203 @@ WaveFile load_wav(const char* path) {
                 fread(sample_loop, sizeof(SampleLoop), sampler.sample_loops, file);
                 wave.loop_start = sample_loop[0].start;
                 wave.loop_end = sample_loop[0].end;
+                free(sample_loop);
+            }
+        }
+
+        // Cue points, e.g. the hits in a drum loop
+        else if (strcmp(name, "cue ") == 0 && size >= 4) {
+            uint32_t n_cues = 0;
+            fread(&n_cues, sizeof(n_cues), 1, file);
+            if (n_cues > (size - 4) / 24) n_cues = (size - 4) / 24;
+            wave.cues = (WaveCue*)malloc((n_cues + 1) * sizeof(WaveCue));
+            for (uint32_t i = 0; i < n_cues; ++i) {
+                // ID, position, data chunk ID, chunk start, block start, sample offset
+                uint32_t cue_point[6];
+                fread(cue_point, sizeof(uint32_t), 6, file);
+                wave.cues[wave.n_cues++] = (WaveCue){ .id = cue_point[0], .position = cue_point[5] };
+            }
+        }
+
+        // Skip to the next chunk, including whatever we didn't read of this one
+        fseek(file, chunk_end, SEEK_SET);
+    }
+    fclose(file);
+
+    // The data chunk may come before the format chunk, so only convert once everything is read
+    if (data != NULL && layout.num_channels > 0) {
+        wave.num_channels = layout.num_channels;
+        wave.length = convert_pcm_data(data, data_size, &layout, channel, dither, &wave.samples);
+    }
+    free(data);
+    return wave;
+}
+
+// Converts the 80-bit IEEE 754 extended precision number that AIFF stores its sample rate in
+static double read_extended_be(const uint8_t* data) {
+    int exponent = ((data[0] & 0x7F) << 8) | data[1];
+    uint64_t mantissa = 0;
+    for (int i = 0; i < 8; ++i) {
+        mantissa = (mantissa << 8) | data[2 + i];
+    }
+    if (exponent == 0 && mantissa == 0) {
+        return 0.0;
+    }
+    double value = ldexp((double)mantissa, exponent - 16383 - 63);
+    return (data[0] & 0x80) ? -value : value;
+}
+
+WaveFile load_aiff(const char* path, int channel, int dither) {
+    WaveFile wave = {
+        .samples = NULL,
+        .sample_rate = 0,
+        .length = -1,
+        .loop_start = -1,
+        .loop_end = -1,
+        .cues = NULL,
+        .n_cues = 0,
+        .num_channels = 0,
+    };
+    PcmLayout layout = { 0 };
+    uint8_t* data = NULL;
+    uint32_t data_size = 0;
+    uint32_t marker_ids[64];
+    uint32_t marker_positions[64];
+    int n_markers = 0;
+    int loop_begin_id = -1;
+    int loop_end_id = -1;
+
+    // Open file
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Failed to open file %s\n", path);
+        return wave;
+    }
+
+    // This should be the FORM AIFF or FORM AIFC chunk
+    uint8_t form[12];
+    if (fread(form, 1, 12, file) != 12 || memcmp(form, "FORM", 4) != 0 || (memcmp(form + 8, "AIFF", 4) != 0 && memcmp(form + 8, "AIFC", 4) != 0)) {
+        printf("Invalid AIFF file\n");
+        fclose(file);
+        return wave;
+    }
+    int is_aifc = (memcmp(form + 8, "AIFC", 4) == 0);
+
+    uint8_t chunk_header[8];
+    while (fread(chunk_header, 1, 8, file) == 8) {
+        uint32_t size = read_u32_be(chunk_header + 4);
+        long chunk_end = ftell(file) + size + (size & 1); // Chunks are padded to an even size
+        uint8_t* chunk = (uint8_t*)malloc(size + 1);
+        uint32_t chunk_size = fread(chunk, 1, size, file);
+
+        // Sample metadata
+        if (memcmp(chunk_header, "COMM", 4) == 0 && chunk_size >= 18) {
+            layout.num_channels = read_u16_be(chunk + 0);
+            layout.bits_per_sample = read_u16_be(chunk + 6);
+            layout.is_big_endian = 1;
+            wave.sample_rate = (uint32_t)(read_extended_be(chunk + 8) + 0.5);
+
+            // AIFF-C only supports uncompressed data here, in either byte order, or as floats
+            if (is_aifc && chunk_size >= 22) {
+                if (memcmp(chunk + 18, "sowt", 4) == 0) {
+                    layout.is_big_endian = 0;
+                }
+                else if (memcmp(chunk + 18, "fl32", 4) == 0 || memcmp(chunk + 18, "FL32", 4) == 0) {
+                    layout.is_float = 1;
+                    layout.bits_per_sample = 32;
+                }
+                else if (memcmp(chunk + 18, "fl64", 4) == 0 || memcmp(chunk + 18, "FL64", 4) == 0) {
+                    layout.is_float = 1;
+                    layout.bits_per_sample = 64;
+                }
+                else if (memcmp(chunk + 18, "NONE", 4) != 0 && memcmp(chunk + 18, "twos", 4) != 0) {
+                    printf("Compressed AIFF-C files are not supported!\n");
+                    free(chunk);
+                    fclose(file);
+                    return wave;
+                }
+            }
+
+            // Sample sizes that aren't a multiple of 8 are stored left-aligned in whole bytes
+            layout.bits_per_sample = (layout.bits_per_sample + 7) & ~7;
+        }
+
+        // Wave data, prefixed by an offset to the first frame and a block size
+        else if (memcmp(chunk_header, "SSND", 4) == 0 && chunk_size >= 8) {
+            uint32_t offset = read_u32_be(chunk);
+            if (8 + offset <= chunk_size) {
+                data_size = chunk_size - 8 - offset;
+                data = (uint8_t*)malloc(data_size + 1);
+                memcpy(data, chunk + 8 + offset, data_size);
             }
         }
 
-        // Skip unknown chunk
-        else {
-            fseek(file, size, SEEK_CUR);
+        // Markers, referred to by the loops in the instrument chunk
+        else if (memcmp(chunk_header, "MARK", 4) == 0 && chunk_size >= 2) {
+            int n = read_u16_be(chunk);
+            uint32_t pos = 2;
+            for (int i = 0; i < n && n_markers < 64 && pos + 7 <= chunk_size; ++i) {
+                marker_ids[n_markers] = read_u16_be(chunk + pos);
+                marker_positions[n_markers] = read_u32_be(chunk + pos + 2);
+                n_markers++;
+
+                // Skip the marker name, a Pascal string padded to an even size including its length byte
+                uint32_t name_length = chunk[pos + 6];
+                pos += 6 + ((1 + name_length + 1) & ~1);
+            }
+        }
+
+        // Instrument info, the sustain loop is the one that gets played while the note is held
+        else if (memcmp(chunk_header, "INST", 4) == 0 && chunk_size >= 14) {
+            uint16_t play_mode = read_u16_be(chunk + 8);
+            if (play_mode != 0) {
+                loop_begin_id = read_u16_be(chunk + 10);
+                loop_end_id = read_u16_be(chunk + 12);
+            }
+        }
+
+        free(chunk);
+        fseek(file, chunk_end, SEEK_SET);
+    }
+    fclose(file);
+
+    // Markers sit between frames, so the loop ends on the frame before the end marker
+    for (int i = 0; i < n_markers; ++i) {
+        if ((int)marker_ids[i] == loop_begin_id) wave.loop_start = marker_positions[i];
+        if ((int)marker_ids[i] == loop_end_id) wave.loop_end = (int)marker_positions[i] - 1;
+    }
+    if (wave.loop_start < 0 || wave.loop_end < wave.loop_start) {
+        wave.loop_start = -1;
+        wave.loop_end = -1;
+    }
+
+    // Markers double as cue points
+    if (n_markers > 0) {
+        wave.cues = (WaveCue*)malloc(n_markers * sizeof(WaveCue));
+        for (int i = 0; i < n_markers; ++i) {
+            wave.cues[wave.n_cues++] = (WaveCue){ .id = marker_ids[i], .position = marker_positions[i] };
         }
     }
 
+    if (data != NULL && layout.num_channels > 0) {
+        wave.num_channels = layout.num_channels;
+        wave.length = convert_pcm_data(data, data_size, &layout, channel, dither, &wave.samples);
+    }
+    free(data);
     return wave;
 }
+
+// Loads a WAV or AIFF(-C) file as mono 16-bit, based on its contents rather than its extension
+WaveFile load_sample(const char* path, int channel, int dither) {
+    char magic[4] = { 0 };
+    FILE* file = fopen(path, "rb");
+    if (file != NULL) {
+        fread(magic, 1, 4, file);
+        fclose(file);
+    }
+    if (memcmp(magic, "FORM", 4) == 0) {
+        return load_aiff(path, channel, dither);
+    }
+    return load_wav(path, channel, dither);
+}
 #endif